@@ -0,0 +1,118 @@
+#include "compress.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+
+namespace jcs {
+namespace {
+
+constexpr std::size_t kMinMatch = 4;
+constexpr std::size_t kMaxOffset = 0xFFFF;
+constexpr int kHashBits = 14;
+
+std::uint32_t Load32(const char* p) {
+  std::uint32_t x;
+  std::memcpy(&x, p, sizeof(x));
+  return x;
+}
+
+void WriteLength(std::string& output, std::size_t length) {
+  while (length >= 255) {
+    output.push_back(char(255));
+    length -= 255;
+  }
+  output.push_back(char(length));
+}
+
+void WriteSequence(std::string& output, std::string_view literals,
+                   std::size_t offset, std::size_t match) {
+  const std::size_t literal_nibble = std::min<std::size_t>(literals.size(), 15);
+  const std::size_t match_nibble =
+      match ? std::min<std::size_t>(match - kMinMatch, 15) : 0;
+  output.push_back(char(literal_nibble << 4 | match_nibble));
+  if (literal_nibble == 15) WriteLength(output, literals.size() - 15);
+  output += literals;
+  if (match == 0) return;
+  output.push_back(char(offset));
+  output.push_back(char(offset >> 8));
+  if (match_nibble == 15) WriteLength(output, match - kMinMatch - 15);
+}
+
+[[noreturn]] void Corrupt() {
+  throw std::runtime_error("Corrupt compressed block");
+}
+
+}  // namespace
+
+void Compress(std::string_view input, std::string& output) {
+  // table[h] is one more than the last position with a 4-byte prefix hashing
+  // to h, or 0 if there is no such position.
+  std::vector<std::uint32_t> table(1 << kHashBits);
+  const char* const begin = input.data();
+  const char* const end = begin + input.size();
+  const char* anchor = begin;
+  const char* p = begin;
+  while (end - p >= std::ptrdiff_t(kMinMatch)) {
+    const std::uint32_t sequence = Load32(p);
+    const std::uint32_t hash =
+        (sequence * 2654435761u) >> (32 - kHashBits);
+    const std::uint32_t previous = table[hash];
+    table[hash] = std::uint32_t(p - begin + 1);
+    const char* candidate = begin + previous - 1;
+    if (previous == 0 || std::size_t(p - candidate) > kMaxOffset ||
+        Load32(candidate) != sequence) {
+      p++;
+      continue;
+    }
+    const char* match_end = p + kMinMatch;
+    const char* c = candidate + kMinMatch;
+    while (match_end != end && *match_end == *c) match_end++, c++;
+    WriteSequence(output, std::string_view(anchor, p), p - candidate,
+                  match_end - p);
+    p = anchor = match_end;
+  }
+  WriteSequence(output, std::string_view(anchor, end), 0, 0);
+}
+
+void Decompress(std::string_view input, std::size_t size,
+                std::string& output) {
+  const std::size_t start = output.size();
+  output.reserve(start + size);
+  const char* p = input.data();
+  const char* const end = p + input.size();
+  const auto read_length = [&](std::size_t length) {
+    if (length != 15) return length;
+    while (true) {
+      if (p == end) Corrupt();
+      const std::uint8_t extra = *p++;
+      length += extra;
+      if (extra != 255) return length;
+    }
+  };
+  while (true) {
+    if (p == end) Corrupt();
+    const std::uint8_t token = *p++;
+    const std::size_t literals = read_length(token >> 4);
+    if (std::size_t(end - p) < literals) Corrupt();
+    output.append(p, literals);
+    p += literals;
+    if (p == end) break;
+    if (end - p < 2) Corrupt();
+    const std::size_t offset = std::uint8_t(p[0]) | std::uint8_t(p[1]) << 8;
+    p += 2;
+    const std::size_t match = read_length(token & 15) + kMinMatch;
+    if (offset == 0 || offset > output.size() - start) Corrupt();
+    if (output.size() - start + match > size) Corrupt();
+    const std::size_t position = output.size();
+    output.resize(position + match);
+    char* const out = output.data() + position;
+    // The match may overlap the bytes it is producing, so copy forwards.
+    for (std::size_t i = 0; i < match; i++) out[i] = out[i - offset];
+  }
+  if (output.size() - start != size) Corrupt();
+}
+
+}  // namespace jcs
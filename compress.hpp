@@ -0,0 +1,28 @@
+#ifndef COMPRESS_HPP_
+#define COMPRESS_HPP_
+
+#include <string>
+#include <string_view>
+
+namespace jcs {
+
+// A byte-oriented LZ77 block format in the style of LZ4. Each block is
+// independent: it can be decompressed without any other block.
+//
+// A block is a sequence of (literals, match) pairs. Each pair starts with
+// a token byte whose high nibble is the literal length and whose low nibble is
+// the match length minus 4. A nibble of 15 is followed by extra length bytes
+// which are summed until one is less than 255. The literals follow, then
+// a 2-byte little-endian offset back into the output and any extra match
+// length bytes. The final pair of a block only has literals.
+
+// Compress `input` as a single block and append it to `output`.
+void Compress(std::string_view input, std::string& output);
+
+// Decompress a block which expands to exactly `size` bytes, appending the
+// result to `output`. Throws if the block is corrupt.
+void Decompress(std::string_view input, std::size_t size, std::string& output);
+
+}  // namespace jcs
+
+#endif  // COMPRESS_HPP_
@@ -1,15 +1,24 @@
 #include "index.hpp"
 
+#include "compress.hpp"
+#include "policy.hpp"
 #include "serial.hpp"
 
 #include <algorithm>
 #include <array>
+#include <bit>
+#include <charconv>
 #include <chrono>
+#include <exception>
 #include <filesystem>
+#include <format>
 #include <fstream>
+#include <iterator>
+#include <limits>
+#include <map>
 #include <print>
 #include <ranges>
-#include <set>
+#include <stdexcept>
 #include <thread>
 
 namespace jcs {
@@ -24,52 +33,414 @@ using std::chrono_literals::operator""s;
 constexpr int kMaxMatchesInFile = 5;
 constexpr int kMaxMatchedFiles = 5;
 
-using SnippetTable = std::array<std::vector<Index::FileID>, kNumSnippets>;
+// Posting lists for every snippet, followed by the sparse grams if the index
+// includes them.
+using SnippetTable = std::vector<std::vector<Index::ContentID>>;
+using NameTable = std::array<std::vector<Index::FileID>, kNumSnippets>;
+
+// Stored contents are split into independently compressed blocks of this size.
+constexpr std::size_t kStoredBlockSize = 1 << 16;
+
+// The index is written out in chunks of roughly this size.
+constexpr std::size_t kChunkSize = 1 << 20;
+
+// Every index file starts with these, so that an index written by a different
+// version of jcs is reported instead of misread. The version must change
+// whenever the layout does.
+constexpr std::uint64_t kIndexMagic = 0x5845444e4953434a;  // "JCSINDEX"
+constexpr std::uint64_t kIndexVersion = 2;
 
 std::chrono::milliseconds to_milliseconds(std::chrono::nanoseconds x) {
   return std::chrono::duration_cast<std::chrono::milliseconds>(x);
 }
 
+// File names are stored as absolute paths. Returns the prefix they share: the
+// directory containing the index at `index_path`.
+std::string RootPrefix(std::string_view index_path) {
+  return (fs::absolute(index_path).parent_path() / "").string();
+}
+
+// Returns the part of `name` below `root`, which is what file filters match so
+// that the directories above the root do not match every file.
+std::string_view RelativeName(std::string_view name, std::string_view root) {
+  if (name.starts_with(root)) name.remove_prefix(root.size());
+  return name;
+}
+
+// Intersects the sorted list `ids` with the sorted `postings`.
+void Intersect(std::vector<std::uint32_t>& ids,
+               std::span<const std::uint32_t> postings) {
+  std::size_t i = 0, j = 0;
+  const std::size_t n = ids.size();
+  for (std::uint32_t x : postings) {
+    if (i == n) break;
+    while (i < n && ids[i] < x) i++;
+    if (i < n && ids[i] == x) ids[j++] = ids[i++];
+  }
+  ids.resize(j);
+}
+
+// Intersects the sorted list `ids` with the postings under `cursor`, skipping
+// over the postings without decoding them into a list first.
+void Intersect(std::vector<std::uint32_t>& ids, PostingCursor cursor) {
+  std::size_t j = 0;
+  for (std::uint32_t x : ids) {
+    cursor.AdvanceTo(x);
+    if (cursor.done()) break;
+    if (cursor.value() == x) ids[j++] = x;
+  }
+  ids.resize(j);
+}
+
+// Returns an opaque timestamp for the last modification of `path`, or 0 if it
+// cannot be determined.
+std::uint64_t ModifiedTime(const fs::path& path) noexcept {
+  std::error_code error;
+  const auto time = fs::last_write_time(path, error);
+  if (error) return 0;
+  return std::uint64_t(time.time_since_epoch().count());
+}
+
+// Compresses file contents for storage in the index: the uncompressed size,
+// followed by each block preceded by its compressed size.
+std::string StoreContents(std::string_view contents) {
+  std::string result, block;
+  Writer writer(result);
+  writer.WriteVarUint64(contents.size());
+  for (std::size_t i = 0; i < contents.size(); i += kStoredBlockSize) {
+    block.clear();
+    Compress(contents.substr(i, kStoredBlockSize), block);
+    writer.WriteVarUint64(block.size());
+    writer.Write(block);
+  }
+  return result;
+}
+
+// A temporary file for data which does not fit in the memory budget of a build.
+// The file is removed when the object is destroyed.
+class ScratchFile {
+ public:
+  explicit ScratchFile(fs::path path)
+      : path_(std::move(path)),
+        file_(path_, std::ios::in | std::ios::out | std::ios::binary |
+                         std::ios::trunc) {
+    file_.exceptions(std::ios::failbit | std::ios::badbit);
+  }
+
+  ~ScratchFile() {
+    file_.close();
+    std::error_code error;
+    fs::remove(path_, error);
+  }
+
+  // Not copyable.
+  ScratchFile(const ScratchFile&) = delete;
+  ScratchFile& operator=(const ScratchFile&) = delete;
+
+  // Appends `data` to the end of the file.
+  void Write(std::string_view data) {
+    file_.write(data.data(), data.size());
+    size_ += data.size();
+  }
+
+  void Flush() { file_.flush(); }
+
+  // Reads `size` bytes from `offset` into `output`. The file must be flushed
+  // first.
+  void Read(std::uint64_t offset, std::size_t size, std::string& output) {
+    output.resize(size);
+    file_.seekg(offset);
+    file_.read(output.data(), size);
+  }
+
+  const fs::path& path() const { return path_; }
+  std::uint64_t size() const { return size_; }
+
+ private:
+  fs::path path_;
+  std::fstream file_;
+  std::uint64_t size_ = 0;
+};
+
+// Compressed file contents, which are written to a scratch file when building
+// with a memory budget.
+struct StoredBlob {
+  // Returns the contents, reading them into `buffer` if they are not in memory.
+  std::string_view Get(std::string& buffer) const {
+    if (!scratch) return data;
+    scratch->Read(offset, size, buffer);
+    return buffer;
+  }
+
+  // Moves the contents out of memory and into `file`.
+  void MoveTo(ScratchFile& file) {
+    scratch = &file;
+    offset = file.size();
+    size = data.size();
+    file.Write(data);
+    data = {};
+  }
+
+  std::string data;
+  ScratchFile* scratch = nullptr;
+  std::uint64_t offset = 0;
+  std::size_t size = 0;
+};
+
+// Runs are merged at most this many at a time, so that merging needs a bounded
+// number of open files and read buffers however large the tree is.
+constexpr std::size_t kMaxMergeRuns = 64;
+
+// Marks the end of a run in place of a list ID.
+constexpr std::uint32_t kEndOfRun = std::numeric_limits<std::uint32_t>::max();
+
+// Runs of posting lists are spilled to scratch files. A run holds the non-empty
+// lists in order of ID, each as the ID and a count followed by the FileIDs, and
+// ends with kEndOfRun.
+void WriteRunList(ScratchFile& file, std::uint32_t id,
+                  std::span<const std::uint32_t> list) {
+  const std::uint32_t header[] = {id, std::uint32_t(list.size())};
+  file.Write(std::string_view(reinterpret_cast<const char*>(header),
+                              sizeof(header)));
+  file.Write(std::string_view(reinterpret_cast<const char*>(list.data()),
+                              list.size_bytes()));
+}
+
+void EndRun(ScratchFile& file) {
+  file.Write(std::string_view(reinterpret_cast<const char*>(&kEndOfRun),
+                              sizeof(kEndOfRun)));
+}
+
+// Reads back a run of posting lists from a scratch file.
+class RunReader {
+ public:
+  RunReader(const fs::path& path, std::uint64_t offset)
+      : input_(path, std::ios::binary) {
+    input_.exceptions(std::ios::failbit | std::ios::badbit);
+    input_.seekg(offset);
+    ReadId();
+  }
+
+  // Appends the posting list for `id` to `output`, if the run has one. Lists
+  // must be read in ascending order of ID.
+  void Read(std::uint32_t id, std::vector<std::uint32_t>& output) {
+    if (next_id_ != id) return;
+    std::uint32_t count;
+    input_.read(reinterpret_cast<char*>(&count), sizeof(count));
+    const std::size_t size = output.size();
+    output.resize(size + count);
+    input_.read(reinterpret_cast<char*>(output.data() + size),
+                count * sizeof(std::uint32_t));
+    ReadId();
+  }
+
+ private:
+  void ReadId() {
+    input_.read(reinterpret_cast<char*>(&next_id_), sizeof(next_id_));
+  }
+
+  std::ifstream input_;
+  std::uint32_t next_id_ = kEndOfRun;
+};
+
+// Tracks which files have byte-identical contents so that each distinct content
+// is only indexed (and later verified) once.
+class ContentTable {
+ public:
+  explicit ContentTable(std::span<const std::string> files)
+      : files_(files), representative_(files.size()) {
+    for (Index::FileID i = 0; i < files.size(); i++) representative_[i] = i;
+  }
+
+  // Returns true if `file_id` is the first file seen with these contents, in
+  // which case the caller is responsible for indexing it. Otherwise, the file
+  // is recorded as a duplicate of the earlier one.
+  bool Claim(Index::FileID file_id, std::string_view contents) {
+    const Key key{contents.size(), Fingerprint(contents)};
+    std::unique_lock lock(mutex_);
+    const auto [i, inserted] = first_.try_emplace(key, file_id);
+    if (inserted) return true;
+    const Index::FileID other = i->second;
+    lock.unlock();
+    // Guard against fingerprint collisions: a file which merely has the same
+    // fingerprint is indexed as distinct content.
+    try {
+      if (MemoryMappedFile(files_[other]).Contents() != contents) return true;
+    } catch (std::exception&) {
+      return true;
+    }
+    representative_[file_id] = other;
+    return false;
+  }
+
+  // Assigns a ContentID to every distinct content among the files which are
+  // kept. content_ids[f] is the ContentID for file f, and content_ids is
+  // monotonic across the files which were indexed so that remapping a sorted
+  // posting list keeps it sorted. contents[c] lists the files which share
+  // content c, in ascending order, numbered after removing the files which are
+  // not kept.
+  void Assign(std::span<const bool> keep,
+              std::vector<Index::ContentID>& content_ids,
+              std::vector<std::vector<Index::FileID>>& contents) const {
+    content_ids.assign(representative_.size(), 0);
+    contents.clear();
+    for (Index::FileID f = 0; f < representative_.size(); f++) {
+      if (!keep[f] || representative_[f] != f) continue;
+      content_ids[f] = Index::ContentID(contents.size());
+      contents.emplace_back();
+    }
+    Index::FileID next = 0;
+    for (Index::FileID f = 0; f < representative_.size(); f++) {
+      if (!keep[f]) continue;
+      content_ids[f] = content_ids[representative_[f]];
+      contents[content_ids[f]].push_back(next++);
+    }
+  }
+
+ private:
+  using Key = std::pair<std::size_t, std::uint64_t>;
+
+  // 64-bit FNV-1a.
+  static std::uint64_t Fingerprint(std::string_view contents) noexcept {
+    std::uint64_t hash = 0xcbf29ce484222325;
+    for (char c : contents) hash = (hash ^ std::uint8_t(c)) * 0x100000001b3;
+    return hash;
+  }
+
+  std::span<const std::string> files_;
+  std::mutex mutex_;
+  std::map<Key, Index::FileID> first_;
+  // representative_[f] is the file whose postings stand in for file f.
+  std::vector<Index::FileID> representative_;
+};
+
+// The outcome of indexing a single file.
+struct IndexedFile {
+  Policy::Verdict verdict = Policy::Verdict::kIndex;
+  // The modification time of the file before it was read.
+  std::uint64_t modified = 0;
+};
+
 struct IndexBatch {
-  void IndexFile(Index::FileID file_id, std::string_view path) {
+  IndexedFile IndexFile(const Policy& policy, ContentTable& contents,
+                        Index::FileID file_id, std::string_view path) {
+    IndexedFile result;
     try {
       const auto start = Clock::now();
+      result.modified = ModifiedTime(path);
       const MemoryMappedFile buffer(path);
+      result.verdict = policy.Check(buffer.Contents());
+      if (result.verdict != Policy::Verdict::kIndex ||
+          !contents.Claim(file_id, buffer.Contents())) {
+        open_time += Clock::now() - start;
+        return result;
+      }
       const auto open = Clock::now();
-      std::vector<bool> seen(kNumSnippets);
-      for (auto snippet : std::ranges::views::slide(buffer.Contents(), 3)) {
+      const std::string_view text = buffer.Contents();
+      std::vector<bool> seen(kNumPostingLists);
+      for (auto snippet : std::ranges::views::slide(text, 3)) {
         seen[Hash(std::string_view(snippet))] = true;
       }
-      for (int id = 0; id < kNumSnippets; id++) {
-        if (seen[id]) snippets[id].push_back(file_id);
+      for (auto snippet : std::ranges::views::slide(text, 2)) {
+        seen[ShortHash(std::string_view(snippet))] = true;
+      }
+      for (std::size_t i = 0; i < text.size(); i++) {
+        seen[ShortHash(text.substr(i, 1))] = true;
+      }
+      for (int id = 0; id < kNumPostingLists; id++) {
+        if (!seen[id]) continue;
+        snippets[id].push_back(file_id);
+        num_postings++;
+      }
+      if (policy.sparse_grams) {
+        // Trigrams are already indexed above.
+        sparse_seen.resize(kNumSparseGrams / 64);
+        SparseGrams(text, [&](std::size_t offset, std::size_t length) {
+          if (length == 3) return;
+          const int id =
+              SparseHash(text.substr(offset, length)) - kNumPostingLists;
+          sparse_seen[id / 64] |= std::uint64_t(1) << id % 64;
+        });
+        for (std::size_t i = 0; i < sparse_seen.size(); i++) {
+          for (std::uint64_t bits = std::exchange(sparse_seen[i], 0); bits;
+               bits &= bits - 1) {
+            snippets[kNumPostingLists + i * 64 + std::countr_zero(bits)]
+                .push_back(file_id);
+            num_postings++;
+          }
+        }
+      }
+      if (policy.store_contents) {
+        stored.emplace_back(file_id, StoredBlob());
+        stored.back().second.data = StoreContents(buffer.Contents());
       }
       const auto done = Clock::now();
       open_time += open - start;
       index_time += done - open;
     } catch (std::exception&) {}  // Ignore I/O issues for files, skip them.
+    // Failing to write to the scratch file must fail the build, so this is
+    // outside of the handler above.
+    if (scratch) {
+      if (!stored.empty() && !stored.back().second.scratch) {
+        stored.back().second.MoveTo(*scratch);
+      }
+      if (num_postings * sizeof(Index::FileID) > budget) Spill();
+    }
+    return result;
+  }
+
+  // Writes the posting lists out to a new sorted run in the scratch file.
+  void Spill() {
+    runs.push_back(scratch->size());
+    for (std::uint32_t id = 0; id < snippets.size(); id++) {
+      std::vector<Index::FileID>& list = snippets[id];
+      if (list.empty()) continue;
+      WriteRunList(*scratch, id, list);
+      // Release the memory rather than just clearing the list.
+      list = {};
+    }
+    EndRun(*scratch);
+    num_postings = 0;
   }
 
   SnippetTable snippets;
+  std::size_t num_postings = 0;
+  // One bit for each sparse gram in the file being indexed, kept between files
+  // so that it is only allocated once.
+  std::vector<std::uint64_t> sparse_seen;
+  // Compressed contents for the files which this batch indexed.
+  std::vector<std::pair<Index::FileID, StoredBlob>> stored;
+  // When building with a memory budget, stored contents are written to
+  // `scratch`, as are the posting lists whenever they exceed `budget` bytes.
+  // runs[i] is the offset of the i-th run of posting lists.
+  ScratchFile* scratch = nullptr;
+  std::size_t budget = 0;
+  std::vector<std::uint64_t> runs;
   std::chrono::nanoseconds open_time = {};
   std::chrono::nanoseconds index_time = {};
 };
 
+// Merges the per-worker posting lists, translating each FileID into the
+// ContentID given by `content_ids`.
 std::unique_ptr<SnippetTable> MergeBatches(
-    std::span<const IndexBatch> batches) {
-  auto result = std::make_unique<SnippetTable>();
+    std::span<const IndexBatch> batches,
+    std::span<const Index::ContentID> content_ids) {
+  const int num_lists = batches.front().snippets.size();
+  auto result = std::make_unique<SnippetTable>(num_lists);
   const auto start = Clock::now();
   constexpr int kNumWorkers = 8;
   std::vector<std::jthread> workers(kNumWorkers);
   for (int w = 0; w < kNumWorkers; w++) {
     workers[w] = std::jthread([&, w] {
-      const int batch_start = kNumSnippets * w / kNumWorkers;
-      const int batch_end = kNumSnippets * (w + 1) / kNumWorkers;
+      const int batch_start = num_lists * w / kNumWorkers;
+      const int batch_end = num_lists * (w + 1) / kNumWorkers;
       for (int i = batch_start; i < batch_end; i++) {
         std::vector<Index::FileID>& out = (*result)[i];
         for (const IndexBatch& batch : batches) {
           out.append_range(batch.snippets[i]);
         }
         std::ranges::sort(out);
+        for (Index::FileID& id : out) id = content_ids[id];
       }
     });
   }
@@ -91,29 +462,118 @@ std::unique_ptr<SnippetTable> MergeBatches(
   return result;
 }
 
+// Files which are skipped by the policy, along with the reason.
+using SkippedFiles = std::vector<std::pair<std::string, Policy::Verdict>>;
+
 class Indexer {
  public:
+  // Prepares to write an index to `path`.
+  explicit Indexer(std::string_view path)
+      : path_(path), root_(RootPrefix(path)) {}
+
   void IndexAll() {
-    files_ = DiscoverFiles();
+    const Policy policy = Policy::Load(fs::current_path() / ".jcspolicy");
+    SkippedFiles skipped;
+    std::vector<std::string> files = DiscoverFiles(policy, skipped);
+    IndexFiles(policy, std::move(files), std::move(skipped));
+  }
+
+  // Lists the files below the current directory which the policy allows, in
+  // order, and adds those which are too large to `skipped`.
+  static std::vector<std::string> DiscoverFiles(const Policy& policy,
+                                                SkippedFiles& skipped) {
+    const auto start = Clock::now();
+    const fs::path root = fs::current_path();
+    std::vector<std::string> files;
+    auto i = fs::recursive_directory_iterator(
+        root, fs::directory_options::skip_permission_denied);
+    for (; i != fs::recursive_directory_iterator(); ++i) {
+      const fs::directory_entry& entry = *i;
+      const fs::path& path = entry.path();
+      std::error_code error;
+      std::string path_string, relative_path;
+      // Windows throws an exception when converting a non-ascii name to
+      // a string. We probably don't have enough non-ascii filenames for code
+      // that this matters much, so skip them.
+      //
+      // There isn't really a trivial fix for this. The easiest thing to do
+      // would be to use std::wstring for all filenames and only have to deal
+      // with casting those wide chars when reading or writing the index file.
+      // Ideally we would use UTF-8 but there is no UTF-8 overload for
+      // CreateFile, only the ascii one and the wide character one.
+      try {
+        path_string = path.string();
+        relative_path = path.lexically_relative(root).generic_string();
+      } catch (std::system_error&) {
+        if (entry.is_directory(error)) i.disable_recursion_pending();
+        continue;
+      }
+      if (entry.is_directory(error)) {
+        if (!policy.AllowDirectory(relative_path)) {
+          i.disable_recursion_pending();
+        }
+        continue;
+      }
+      if (!policy.AllowFile(relative_path)) continue;
+      if (entry.file_size(error) > policy.max_file_size && !error) {
+        skipped.emplace_back(std::move(path_string),
+                             Policy::Verdict::kTooLarge);
+        continue;
+      }
+      files.push_back(std::move(path_string));
+    }
+    std::ranges::sort(files);
+    const auto end = Clock::now();
+    std::println("discovering: {}", to_milliseconds(end - start));
+    return files;
+  }
+
+  // Indexes `files`, which must be sorted.
+  void IndexFiles(const Policy& policy, std::vector<std::string> files,
+                  SkippedFiles skipped) {
+    files_ = std::move(files);
+    ContentTable contents(files_);
+    std::vector<IndexedFile> results(files_.size());
     // Use multiple threads to index the files. Threads create separate indices
     // which are merged at the end.
     std::atomic_int done = 0, next = 0;
     constexpr int kNumWorkers = 8;
     std::vector<IndexBatch> batches(kNumWorkers);
+    sparse_ = policy.sparse_grams;
+    for (IndexBatch& batch : batches) batch.snippets.resize(NumPostingLists());
+    if (policy.build_memory != 0) {
+      // Each worker gets an equal share of the budget.
+      for (int i = 0; i < kNumWorkers; i++) {
+        scratch_.push_back(std::make_unique<ScratchFile>(
+            std::format("{}.scratch{}", path_, i)));
+        batches[i].scratch = scratch_.back().get();
+        batches[i].budget = policy.build_memory / kNumWorkers;
+      }
+    }
+    // An error in one worker, e.g. failing to write to the scratch file, stops
+    // the others and is rethrown here once they have finished.
+    std::vector<std::exception_ptr> errors(kNumWorkers);
+    std::atomic_bool failed = false;
     std::vector<std::jthread> workers(kNumWorkers);
     for (int i = 0; i < kNumWorkers; i++) {
       auto& batch = batches[i];
-      workers[i] = std::jthread([this, &batch, &done, &next] {
-        while (true) {
-          const Index::FileID file_id =
-              next.fetch_add(1, std::memory_order_relaxed);
-          if (file_id >= files_.size()) break;
-          batch.IndexFile(file_id, files_[file_id]);
-          done.fetch_add(1, std::memory_order_relaxed);
+      workers[i] = std::jthread([&, i, this] {
+        try {
+          while (!failed.load(std::memory_order_relaxed)) {
+            const Index::FileID file_id =
+                next.fetch_add(1, std::memory_order_relaxed);
+            if (file_id >= files_.size()) break;
+            results[file_id] =
+                batch.IndexFile(policy, contents, file_id, files_[file_id]);
+            done.fetch_add(1, std::memory_order_relaxed);
+          }
+        } catch (...) {
+          errors[i] = std::current_exception();
+          failed = true;
         }
       });
     }
-    while (true) {
+    while (!failed) {
       const int current = done.load(std::memory_order_relaxed);
       if (current == files_.size()) break;
       std::print("\r{:7d}/{} {:3d}%", current, files_.size(),
@@ -121,100 +581,318 @@ class Indexer {
       std::fflush(stdout);
       std::this_thread::sleep_for(100ms);
     }
-    std::println("\r{0:7d}/{0} 100%", files_.size());
     for (std::jthread& worker : workers) worker.join();
-    snippets_ = MergeBatches(batches);
+    for (const std::exception_ptr& error : errors) {
+      if (error) std::rethrow_exception(error);
+    }
+    std::println("\r{0:7d}/{0} 100%", files_.size());
+    // Drop the files which the policy rejected based on their contents.
+    std::vector<std::string> kept;
+    auto keep = std::make_unique<bool[]>(files_.size());
+    for (Index::FileID f = 0; f < files_.size(); f++) {
+      keep[f] = results[f].verdict == Policy::Verdict::kIndex;
+      if (keep[f]) {
+        kept.push_back(std::move(files_[f]));
+        modified_.push_back(results[f].modified);
+      } else {
+        skipped.emplace_back(std::move(files_[f]), results[f].verdict);
+      }
+    }
+    std::vector<Index::ContentID> content_ids;
+    contents.Assign(std::span(keep.get(), files_.size()), content_ids,
+                    contents_);
+    files_ = std::move(kept);
+    if (policy.store_contents) {
+      // Contents which could not be read are stored as empty.
+      stored_.resize(contents_.size());
+      for (StoredBlob& blob : stored_) blob.data = StoreContents("");
+      for (IndexBatch& batch : batches) {
+        for (auto& [file, blob] : batch.stored) {
+          stored_[content_ids[file]] = std::move(blob);
+        }
+        batch.stored.clear();
+      }
+    }
+    std::ranges::sort(skipped);
+    for (const auto& [file, verdict] : skipped) {
+      std::println("skipped ({}): {}", ToString(verdict), file);
+    }
+    std::println("skipped: {}", skipped.size());
+    std::println("unique contents: {}", contents_.size());
+    if (scratch_.empty()) {
+      snippets_ = MergeBatches(batches, content_ids);
+      return;
+    }
+    // The runs are merged as the index is saved, so that the merged posting
+    // lists never need to be in memory all at once.
+    for (IndexBatch& batch : batches) {
+      batch.Spill();
+      for (std::uint64_t offset : batch.runs) {
+        runs_.emplace_back(batch.scratch, offset);
+      }
+    }
+    for (auto& scratch : scratch_) scratch->Flush();
+    std::println("runs: {}", runs_.size());
+    ReduceRuns();
+    content_ids_ = std::move(content_ids);
+  }
+
+  // Replaces everything which has been indexed, e.g. with the result of
+  // merging several indices.
+  void Assign(std::vector<std::string> files,
+              std::vector<std::vector<Index::FileID>> contents,
+              std::vector<std::string> stored,
+              std::vector<std::uint64_t> modified,
+              std::unique_ptr<SnippetTable> snippets) {
+    files_ = std::move(files);
+    contents_ = std::move(contents);
+    stored_.resize(stored.size());
+    for (std::size_t c = 0; c < stored.size(); c++) {
+      stored_[c].data = std::move(stored[c]);
+    }
+    modified_ = std::move(modified);
+    snippets_ = std::move(snippets);
+    sparse_ = snippets_->size() > kNumPostingLists;
+  }
+
+  // Marks the index as including generation `generation` of the changes, and
+  // as replacing or deleting the earlier versions of `tombstones`.
+  void SetGeneration(std::uint64_t generation,
+                     std::vector<std::string> tombstones) {
+    generation_ = generation;
+    tombstones_ = std::move(tombstones);
   }
 
-  void Save(std::string_view path) const {
+  void Save() const {
     const auto start = Clock::now();
-    // Variable-length data.
+    // Write to a temporary file first so that readers never see a partially
+    // written index.
+    const std::string temporary = std::format("{}.tmp", path_);
+    std::ofstream out{temporary, std::ios::binary};
+    out.exceptions(std::ostream::failbit | std::ostream::badbit);
+    // The tables come first but hold offsets into the data, so leave space for
+    // them and fill them in at the end.
+    const std::size_t tables_size =
+        sizeof(std::uint64_t) *
+        (NumPostingLists() + kNumSnippets + 9 + files_.size() +
+         contents_.size() + stored_.size() + modified_.size() +
+         tombstones_.size());
+    out.write(std::string(tables_size, '\0').data(), tables_size);
+    // Variable-length data, which is written out in chunks.
     std::string data;
+    std::uint64_t written = 0;
+    const auto offset = [&] { return written + data.size(); };
+    const auto flush = [&](std::size_t threshold) {
+      if (data.size() < threshold) return;
+      out.write(data.data(), data.size());
+      written += data.size();
+      data.clear();
+    };
     // filename_offsets[i] is the offset of files[i] in data.
     std::vector<std::uint64_t> filename_offsets;
-    // snippets_offsets[i] is the offset of snippets[i] in data.
+    // content_offsets[i] is the offset of the file list for contents[i].
+    std::vector<std::uint64_t> content_offsets;
+    // stored_offsets[i] is the offset of the stored contents for contents[i].
+    std::vector<std::uint64_t> stored_offsets;
+    // names_offsets[i] is the offset of the file name posting list i in data.
+    std::vector<std::uint64_t> names_offsets;
+    // tombstone_offsets[i] is the offset of tombstones[i] in data.
+    std::vector<std::uint64_t> tombstone_offsets;
+    // snippets_offsets[i] is the offset of snippets[i] in data, including the
+    // sparse grams.
     std::vector<std::uint64_t> snippets_offsets;
     {
       Writer writer(data);
-      for (std::string_view file : files_) {
-        filename_offsets.push_back(data.size());
-        writer.WriteVarUint64(file.size());
-        writer.Write(file);
+      std::vector<Index::ContentID> file_contents(files_.size());
+      for (Index::ContentID c = 0; c < contents_.size(); c++) {
+        for (Index::FileID file : contents_[c]) file_contents[file] = c;
       }
-      for (std::span<const Index::FileID> list : *snippets_) {
-        snippets_offsets.push_back(data.size());
+      for (Index::FileID f = 0; f < files_.size(); f++) {
+        filename_offsets.push_back(offset());
+        writer.WriteVarUint64(files_[f].size());
+        writer.Write(files_[f]);
+        writer.WriteVarUint64(file_contents[f]);
+        flush(kChunkSize);
+      }
+      for (std::string_view tombstone : tombstones_) {
+        tombstone_offsets.push_back(offset());
+        writer.WriteVarUint64(tombstone.size());
+        writer.Write(tombstone);
+        flush(kChunkSize);
+      }
+      for (std::span<const Index::FileID> list : contents_) {
+        content_offsets.push_back(offset());
         writer.WriteVarUint64(list.size());
         Index::FileID previous = 0;
         for (Index::FileID file : list) {
-          // This is always positive because the list is sorted.
-          const std::uint64_t delta = file - previous;
+          writer.WriteVarUint64(file - previous);
           previous = file;
+        }
+        flush(kChunkSize);
+      }
+      std::string buffer;
+      for (const StoredBlob& blob : stored_) {
+        stored_offsets.push_back(offset());
+        writer.Write(blob.Get(buffer));
+        flush(kChunkSize);
+      }
+      const auto write_postings = [&](std::span<const std::uint32_t> list) {
+        writer.WriteVarUint64(list.size());
+        std::uint32_t previous = 0;
+        for (std::uint32_t id : list) {
+          // This is always positive because the list is sorted.
+          const std::uint64_t delta = id - previous;
+          previous = id;
           writer.WriteVarUint64(delta);
         }
+        flush(kChunkSize);
+      };
+      std::vector<RunReader> runs;
+      for (const auto& [scratch, run] : runs_) {
+        runs.emplace_back(scratch->path(), run);
       }
+      std::vector<Index::ContentID> merged;
+      for (int id = 0; id < NumPostingLists(); id++) {
+        snippets_offsets.push_back(offset());
+        if (snippets_) {
+          write_postings((*snippets_)[id]);
+          continue;
+        }
+        // Merge the list from every run, translating FileIDs to ContentIDs.
+        merged.clear();
+        for (RunReader& run : runs) run.Read(id, merged);
+        std::ranges::sort(merged);
+        for (Index::ContentID& c : merged) c = content_ids_[c];
+        write_postings(merged);
+      }
+      for (std::span<const Index::FileID> list : *IndexNames()) {
+        names_offsets.push_back(offset());
+        write_postings(list);
+      }
+      flush(0);
     }
     std::string tables;
     Writer writer(tables);
-    for (std::uint64_t offset : snippets_offsets) writer.WriteUint64(offset);
+    writer.WriteUint64(kIndexMagic);
+    writer.WriteUint64(kIndexVersion);
+    const std::span<const std::uint64_t> sparse_offsets =
+        std::span(snippets_offsets).subspan(kNumPostingLists);
+    for (std::uint64_t offset :
+         std::span(snippets_offsets).first(kNumPostingLists)) {
+      writer.WriteUint64(offset);
+    }
     writer.WriteUint64(std::uint32_t(filename_offsets.size()));
     for (std::uint64_t offset : filename_offsets) writer.WriteUint64(offset);
-    std::ofstream out{std::string(path), std::ios::binary};
-    out.exceptions(std::ostream::failbit | std::ostream::badbit);
+    writer.WriteUint64(content_offsets.size());
+    for (std::uint64_t offset : content_offsets) writer.WriteUint64(offset);
+    writer.WriteUint64(stored_offsets.size());
+    for (std::uint64_t offset : stored_offsets) writer.WriteUint64(offset);
+    writer.WriteUint64(modified_.size());
+    for (std::uint64_t time : modified_) writer.WriteUint64(time);
+    for (std::uint64_t offset : names_offsets) writer.WriteUint64(offset);
+    writer.WriteUint64(generation_);
+    writer.WriteUint64(tombstone_offsets.size());
+    for (std::uint64_t offset : tombstone_offsets) writer.WriteUint64(offset);
+    writer.WriteUint64(sparse_offsets.size());
+    for (std::uint64_t offset : sparse_offsets) writer.WriteUint64(offset);
+    out.seekp(0);
     out.write(tables.data(), tables.size());
-    out.write(data.data(), data.size());
+    out.close();
+    fs::rename(temporary, path_);
     const auto end = Clock::now();
     std::println("saving: {}", to_milliseconds(end - start));
   }
 
  private:
-  static std::vector<std::string> DiscoverFiles() {
-    const auto start = Clock::now();
-    const std::set<fs::path> allowed = {
-        ".bat", ".cc",   ".cmake",   ".conf", ".cpp",   ".cs",  ".csproj",
-        ".css", ".csv",  ".fsproj",  ".h",    ".hpp",   ".hs",  ".html",
-        ".js",  ".json", ".md",      ".py",   ".props", ".ps1", ".targets",
-        ".tsv", ".txt",  ".vcxproj", ".xml",
-    };
-    const std::set<fs::path> allowed_dot_directories = {".config"};
-    std::vector<std::string> files;
-    for (const fs::path& path : fs::recursive_directory_iterator(
-             fs::current_path(),
-             fs::directory_options::skip_permission_denied)) {
-      if (!allowed.contains(path.extension())) continue;
-      std::string path_string;
-      // Windows throws an exception when converting a non-ascii name to
-      // a string. We probably don't have enough non-ascii filenames for code
-      // that this matters much, so skip them.
-      //
-      // There isn't really a trivial fix for this. The easiest thing to do
-      // would be to use std::wstring for all filenames and only have to deal
-      // with casting those wide chars when reading or writing the index file.
-      // Ideally we would use UTF-8 but there is no UTF-8 overload for
-      // CreateFile, only the ascii one and the wide character one.
-      try {
-        path_string = path.string();
-      } catch (std::system_error&) {
-        continue;
+  int NumPostingLists() const {
+    return sparse_ ? kNumPostingLists + kNumSparseGrams : kNumPostingLists;
+  }
+
+  // Merges groups of runs into longer ones until there are few enough to merge
+  // at once while saving.
+  void ReduceRuns() {
+    // The file holding the runs from the previous pass, which is removed once
+    // they have been merged.
+    std::unique_ptr<ScratchFile> previous;
+    std::vector<std::uint32_t> merged;
+    for (int pass = 0; runs_.size() > kMaxMergeRuns; pass++) {
+      auto output = std::make_unique<ScratchFile>(
+          std::format("{}.merge{}", path_, pass));
+      std::vector<std::pair<ScratchFile*, std::uint64_t>> runs;
+      for (std::size_t i = 0; i < runs_.size(); i += kMaxMergeRuns) {
+        std::vector<RunReader> readers;
+        for (const auto& [scratch, run] : std::span(runs_).subspan(
+                 i, std::min(kMaxMergeRuns, runs_.size() - i))) {
+          readers.emplace_back(scratch->path(), run);
+        }
+        runs.emplace_back(output.get(), output->size());
+        for (int id = 0; id < NumPostingLists(); id++) {
+          merged.clear();
+          for (RunReader& reader : readers) reader.Read(id, merged);
+          if (merged.empty()) continue;
+          std::ranges::sort(merged);
+          WriteRunList(*output, id, merged);
+        }
+        EndRun(*output);
       }
-      const auto is_allowed_directory = [&](const fs::path& directory) {
-        const std::string d = directory.string();
-        return !d.starts_with(".") || allowed_dot_directories.contains(d);
-      };
-      if (!std::ranges::all_of(path.parent_path(), is_allowed_directory)) {
-        continue;
+      output->Flush();
+      runs_ = std::move(runs);
+      previous = std::move(output);
+      std::println("merged into {} runs", runs_.size());
+    }
+    if (previous) scratch_.push_back(std::move(previous));
+  }
+
+  // Builds posting lists of FileIDs for the trigrams in each file name below
+  // the root.
+  std::unique_ptr<NameTable> IndexNames() const {
+    auto names = std::make_unique<NameTable>();
+    for (Index::FileID f = 0; f < files_.size(); f++) {
+      const std::string_view name = RelativeName(files_[f], root_);
+      for (auto trigram : std::ranges::views::slide(name, 3)) {
+        std::vector<Index::FileID>& list =
+            (*names)[Hash(std::string_view(trigram))];
+        if (list.empty() || list.back() != f) list.push_back(f);
       }
-      files.push_back(std::move(path_string));
     }
-    std::ranges::sort(files);
-    const auto end = Clock::now();
-    std::println("discovering: {}", to_milliseconds(end - start));
-    return files;
+    return names;
   }
 
   std::vector<std::string> files_;
+  // contents_[c] lists the files whose contents are identical to content c.
+  std::vector<std::vector<Index::FileID>> contents_;
+  // When storing contents, stored_[c] is the compressed data for content c.
+  std::vector<StoredBlob> stored_;
+  // modified_[f] is the modification time of file f when it was indexed.
+  std::vector<std::uint64_t> modified_;
   std::unique_ptr<SnippetTable> snippets_;
+  // Whether the posting lists include sparse grams.
+  bool sparse_ = false;
+  std::uint64_t generation_ = 0;
+  std::vector<std::string> tombstones_;
+  std::string path_;
+  // The directory containing the index, which file names are relative to.
+  std::string root_;
+  // When building with a memory budget, the posting lists are in sorted runs
+  // in the scratch files instead of `snippets_`, and content_ids_ maps their
+  // FileIDs to ContentIDs. There are at most kMaxMergeRuns runs by the time the
+  // index is saved.
+  std::vector<std::unique_ptr<ScratchFile>> scratch_;
+  std::vector<std::pair<ScratchFile*, std::uint64_t>> runs_;
+  std::vector<Index::ContentID> content_ids_;
 };
 
+// Removes the segments which are included in generation `generation` of the
+// index at `path`. Segments which are in use may fail to be removed, but they
+// are ignored when loading the index.
+void RemoveSegments(std::string_view path, std::uint64_t generation) {
+  for (std::uint64_t segment : FindSegments(path)) {
+    if (segment > generation) break;
+    std::error_code error;
+    fs::remove(SegmentPath(path, segment), error);
+  }
+}
+
 }  // namespace
 
 int Hash(std::string_view term) noexcept {
@@ -223,123 +901,657 @@ int Hash(std::string_view term) noexcept {
   return hash % kNumSnippets;
 }
 
+int SparseHash(std::string_view gram) noexcept {
+  std::uint32_t hash = 0xdeadbeef;
+  for (char c : gram) hash = hash * 109 + c;
+  return kNumPostingLists + hash % kNumSparseGrams;
+}
+
+int ShortHash(std::string_view term) noexcept {
+  if (term.size() == 1) return kNumSnippets + std::uint8_t(term[0]);
+  return kNumSnippets + 256 +
+         (std::uint8_t(term[0]) << 8 | std::uint8_t(term[1]));
+}
+
+void SparseGrams(
+    std::string_view text,
+    const std::function<void(std::size_t offset, std::size_t length)>& gram) {
+  // Pairs of bytes are weighed by a fixed hash, so every index agrees on them.
+  const auto weight = [&](std::size_t i) {
+    std::uint32_t x = std::uint8_t(text[i]) << 8 | std::uint8_t(text[i + 1]);
+    x *= 0x9e3779b1;
+    x ^= x >> 15;
+    x *= 0x85ebca77;
+    return x ^ (x >> 13);
+  };
+  // The pairs which may still start a gram, in decreasing order of weight.
+  // Every pair between two of them weighs no more than the later one.
+  std::vector<std::pair<std::size_t, std::uint32_t>> starts;
+  for (std::size_t end = 0; end + 1 < text.size(); end++) {
+    const std::uint32_t w = weight(end);
+    while (!starts.empty()) {
+      const auto [start, start_weight] = starts.back();
+      const std::size_t length = end + 2 - start;
+      if (length > 2 && length <= kMaxSparseGramLength) gram(start, length);
+      if (start_weight > w) break;
+      starts.pop_back();
+      // A pair of equal weight in between rules out any earlier start.
+      if (start_weight == w) break;
+    }
+    starts.emplace_back(end, w);
+  }
+}
+
+std::vector<std::string_view> CoveringGrams(std::string_view term) {
+  std::vector<std::pair<std::size_t, std::size_t>> grams;
+  SparseGrams(term, [&](std::size_t offset, std::size_t length) {
+    grams.emplace_back(offset, length);
+  });
+  // Sort by start, with the longest first, so that a gram is part of a longer
+  // one exactly when it ends no later than the furthest end seen so far.
+  std::ranges::sort(grams, [](const auto& l, const auto& r) {
+    return l.first != r.first ? l.first < r.first : l.second > r.second;
+  });
+  std::vector<std::string_view> result;
+  std::size_t covered = 0;
+  for (auto [offset, length] : grams) {
+    if (offset + length <= covered) continue;
+    covered = offset + length;
+    result.push_back(term.substr(offset, length));
+  }
+  return result;
+}
+
 Index::Index(std::string_view path) { Load(path); }
 
 void Index::Load(std::string_view path) {
+  // Compacting the index removes the segments which it merged, so if one of
+  // them disappears while loading then the base index has been replaced and
+  // everything is loaded again.
+  constexpr int kMaxAttempts = 3;
+  for (int attempt = 1; ; attempt++) {
+    segments_.clear();
+    LoadFile(path);
+    try {
+      for (std::uint64_t generation : FindSegments(path)) {
+        if (generation <= generation_) continue;
+        auto segment = std::make_unique<Index>();
+        segment->base_ = this;
+        segment->LoadFile(SegmentPath(path, generation));
+        segments_.push_back(std::move(segment));
+      }
+      break;
+    } catch (std::exception&) {
+      if (attempt == kMaxAttempts) throw;
+    }
+  }
+  superseded_.clear();
+  if (segments_.empty()) return;
+  // Find the newest layer which mentions each path. The versions of the file
+  // in older layers are superseded.
+  std::vector<Index*> layers = {this};
+  for (const auto& segment : segments_) layers.push_back(segment.get());
+  std::map<std::string_view, const Index*> latest;
+  for (const Index* layer : layers) {
+    for (FileID f = 0; f < layer->files_.size(); f++) {
+      latest[layer->GetFileName(f)] = layer;
+    }
+    for (std::size_t i = 0; i < layer->tombstones_.size(); i++) {
+      latest[layer->GetTombstone(i)] = layer;
+    }
+  }
+  for (Index* layer : layers) {
+    layer->superseded_.assign(layer->files_.size(), false);
+    for (FileID f = 0; f < layer->files_.size(); f++) {
+      const auto i = latest.find(layer->GetFileName(f));
+      layer->superseded_[f] = i != latest.end() && i->second != layer;
+    }
+  }
+}
+
+void Index::LoadFile(std::string_view path) {
+  cache_.Clear();
   buffer_ = MemoryMappedFile(path);
-  const std::span<const char> contents = buffer_.Contents();
-  const char* p = contents.data();
-  snippets_ = std::span<const std::uint64_t>(
-      reinterpret_cast<const std::uint64_t*>(p), kNumSnippets);
-  p += std::as_bytes(snippets_).size();
-  std::uint64_t num_files;
-  p = ReadUint64(p, num_files);
-  files_ = std::span<const std::uint64_t>(
-      reinterpret_cast<const std::uint64_t*>(p), num_files);
-  p += std::as_bytes(files_).size();
-  data_ = contents.subspan(p - contents.data());
+  root_ = RootPrefix(path);
+  // The tables are checked against the size of the file, so that an old or
+  // damaged index is reported rather than read out of bounds.
+  std::span<const char> rest = buffer_.Contents();
+  const auto invalid = [&] {
+    return std::runtime_error(std::format(
+        "{} is not an index for this version of jcs. Run `jcs --index` to "
+        "rebuild it.",
+        path));
+  };
+  const auto read_uint64 = [&] {
+    if (rest.size() < sizeof(std::uint64_t)) throw invalid();
+    std::uint64_t x;
+    ReadUint64(rest.data(), x);
+    rest = rest.subspan(sizeof(x));
+    return x;
+  };
+  const auto read_table = [&](std::uint64_t size) {
+    if (size > rest.size() / sizeof(std::uint64_t)) throw invalid();
+    const auto table = std::span<const std::uint64_t>(
+        reinterpret_cast<const std::uint64_t*>(rest.data()), size);
+    rest = rest.subspan(std::as_bytes(table).size());
+    return table;
+  };
+  if (read_uint64() != kIndexMagic || read_uint64() != kIndexVersion) {
+    throw invalid();
+  }
+  snippets_ = read_table(kNumPostingLists);
+  files_ = read_table(read_uint64());
+  contents_ = read_table(read_uint64());
+  stored_ = read_table(read_uint64());
+  modified_ = read_table(read_uint64());
+  if (modified_.size() != files_.size()) throw invalid();
+  names_ = read_table(kNumSnippets);
+  generation_ = read_uint64();
+  tombstones_ = read_table(read_uint64());
+  const std::uint64_t num_sparse = read_uint64();
+  if (num_sparse != 0 && num_sparse != kNumSparseGrams) throw invalid();
+  sparse_ = read_table(num_sparse);
+  data_ = rest;
+}
+
+std::uint64_t Index::generation() const {
+  return segments_.empty() ? generation_ : segments_.back()->generation_;
+}
+
+Index::Info Index::GetInfo() const {
+  constexpr std::size_t kNumHeaviest = 10;
+  Info info;
+  info.generation = generation_;
+  info.files = files_.size();
+  info.contents = contents_.size();
+  info.stored = stored_.size();
+  info.tombstones = tombstones_.size();
+  info.segments = segments_.size();
+  for (const auto& segment : segments_) {
+    info.segment_bytes += segment->buffer_.Contents().size();
+  }
+  // Each section of the data starts where the previous one ends, and empty
+  // ones start where the next one does.
+  const std::uint64_t name_postings = names_.front();
+  const std::uint64_t snippet_postings = snippets_.front();
+  const std::uint64_t stored = stored_.empty() ? snippet_postings : stored_[0];
+  const std::uint64_t contents = contents_.empty() ? stored : contents_[0];
+  const std::uint64_t tombstones =
+      tombstones_.empty() ? contents : tombstones_[0];
+  info.sections = {
+      {.name = "tables",
+       .bytes = std::uint64_t(data_.data() - buffer_.Contents().data())},
+      {.name = "file names", .bytes = tombstones},
+      {.name = "tombstones", .bytes = contents - tombstones},
+      {.name = "contents", .bytes = stored - contents},
+      {.name = "stored contents", .bytes = snippet_postings - stored},
+      {.name = "content postings", .bytes = name_postings - snippet_postings},
+      {.name = "name postings", .bytes = data_.size() - name_postings},
+  };
+  // The posting lists are written out one after another, in the order of
+  // these tables, so each one ends where the next begins.
+  const std::span<const std::uint64_t> tables[] = {
+      snippets_.first(kNumSnippets),
+      snippets_.subspan(kNumSnippets),
+      sparse_,
+      names_,
+  };
+  const std::string_view names[] = {"trigrams", "short", "sparse", "names"};
+  std::vector<std::pair<int, std::uint64_t>> trigrams;
+  for (std::size_t t = 0; t < std::size(tables); t++) {
+    Info::Lists& lists = info.lists.emplace_back();
+    lists.name = names[t];
+    lists.lists = tables[t].size();
+    for (std::size_t i = 0; i < tables[t].size(); i++) {
+      std::uint64_t end = data_.size();
+      if (i + 1 < tables[t].size()) {
+        end = tables[t][i + 1];
+      } else if (t + 1 < std::size(tables)) {
+        // The next table may be empty, in which case skip over it.
+        for (std::size_t u = t + 1; u < std::size(tables); u++) {
+          if (tables[u].empty()) continue;
+          end = tables[u].front();
+          break;
+        }
+      }
+      std::uint64_t length;
+      ReadVarUint64(data_.data() + tables[t][i], length);
+      if (length > 0) lists.non_empty++;
+      lists.postings += length;
+      lists.bytes += end - tables[t][i];
+      if (t == 0) {
+        info.histogram[std::bit_width(length)]++;
+        trigrams.emplace_back(int(i), length);
+      }
+    }
+  }
+  const std::size_t heaviest = std::min(kNumHeaviest, trigrams.size());
+  std::ranges::partial_sort(trigrams, trigrams.begin() + heaviest,
+                            std::greater<>(),
+                            &std::pair<int, std::uint64_t>::second);
+  trigrams.resize(heaviest);
+  info.heaviest = std::move(trigrams);
+  return info;
+}
+
+std::vector<const Index*> Index::Layers() const {
+  std::vector<const Index*> layers;
+  for (const auto& segment : segments_ | std::views::reverse) {
+    layers.push_back(segment.get());
+  }
+  layers.push_back(this);
+  return layers;
 }
 
 std::generator<Index::SearchResult> Index::Search(
     std::string_view query) const noexcept {
-  const std::vector<std::string> terms = Terms(query);
-  if (terms.empty()) co_return;
-  for (FileID file : Candidates(terms)) {
-    MemoryMappedFile buffer;
-    try {
-      buffer = MemoryMappedFile(GetFileName(file));
-    } catch (std::exception&) {}
-    const std::string_view file_name = GetFileName(file);
-    std::string_view text = buffer.Contents();
-    int line = 0;
-    while (!text.empty()) {
-      line++;
-      // Consume a line from the input.
-      auto line_end = text.find('\n');
-      std::string_view line_contents;
-      if (line_end == text.npos) {
-        line_contents = text;
-        text = "";
-      } else {
-        line_contents = text.substr(0, line_end);
-        text.remove_prefix(line_end + 1);
-      }
-      // Remove a trailing '\r' which might be present for Windows files.
-      if (!line_contents.empty() && line_contents.back() == '\r') {
-        line_contents.remove_suffix(1);
-      }
-      // Check for a match.
-      const auto column = line_contents.find(terms.front());
-      if (column == line_contents.npos) continue;
-      std::size_t i = column + terms.front().size();
-      bool match = true;
-      for (std::string_view term : std::span(terms).subspan(1)) {
-        const auto c = line_contents.find(term, i);
-        if (c == line_contents.npos) {
-          match = false;
-          break;
+  const Query parsed = Query::Parse(query);
+  if (parsed.expression.empty()) co_return;
+  Searcher searcher(*this, parsed);
+  for (FileMatches found; searcher.Next(found);) {
+    for (const Match& m : found.matches) co_yield ToResult(found.file_name, m);
+  }
+}
+
+void Index::Search(
+    std::string_view query,
+    const std::function<bool(const SearchResult&)>& callback) const {
+  const Query parsed = Query::Parse(query);
+  if (parsed.expression.empty()) return;
+  Searcher searcher(*this, parsed);
+  for (FileMatches found; searcher.Next(found);) {
+    for (const Match& m : found.matches) {
+      if (!callback(ToResult(found.file_name, m))) return;
+    }
+  }
+}
+
+bool Index::Searcher::Next(FileMatches& found) {
+  while (!verifier_ || !verifier_->Next(found)) {
+    if (next_layer_ == layers_.size() || stop_.stop_requested()) return false;
+    const Index& layer = *layers_[next_layer_++];
+    verifier_.reset();
+    allowed_ = layer.FilterFiles(query_);
+    candidates_ = layer.Candidates(query_.expression, allowed_, stop_);
+    verifier_.emplace(layer, query_.expression, candidates_, allowed_, stop_);
+  }
+  return true;
+}
+
+std::generator<Index::SearchResult> Index::Session::Search(
+    std::string_view query, std::stop_token stop) {
+  Query parsed = Query::Parse(query);
+  const Expression& expression = parsed.expression;
+  if (expression.empty()) co_return;
+  // The matches to reuse for the next query, until their lines take up more
+  // than kMaxSessionBytes.
+  std::vector<FileMatches> found;
+  std::size_t kept = 0;
+  bool keep = true;
+  if (Refines(parsed)) {
+    // Every match for the new query was a match for the previous one, so these
+    // lines were within the budget already.
+    for (const FileMatches& previous : found_) {
+      if (stop.stop_requested()) co_return;
+      FileMatches next{.file_name = previous.file_name,
+                       .buffer = previous.buffer,
+                       .matches = {}};
+      for (const Match& m : previous.matches) {
+        if (auto match = MatchLine(expression, m.line_contents, m.line,
+                                   m.offset - m.column)) {
+          next.matches.push_back(*match);
         }
-        i = c + term.size();
       }
-      if (match) {
-        co_yield {.file_name = file_name,
-                  .line = line,
-                  .column = static_cast<int>(column),
-                  .line_contents = line_contents};
+      if (next.matches.empty()) continue;
+      for (const Match& m : next.matches) co_yield ToResult(next.file_name, m);
+      found.push_back(std::move(next));
+    }
+  } else {
+    Searcher searcher(index_, parsed, stop);
+    std::shared_ptr<const Buffer> source;
+    for (FileMatches f; searcher.Next(f);) {
+      if (keep && f.buffer == source) {
+        // Files with identical contents are found one after another, with the
+        // same matches.
+        f.buffer = found.back().buffer;
+        f.matches = found.back().matches;
+      } else if (keep) {
+        source = std::move(f.buffer);
+        f.buffer = KeepLines(f.matches);
+        kept += f.buffer->stored.size();
+        if (kept > kMaxSessionBytes) {
+          keep = false;
+          found = {};
+          source.reset();
+        }
       }
+      for (const Match& m : f.matches) co_yield ToResult(f.file_name, m);
+      if (keep) found.push_back(std::move(f));
+    }
+  }
+  if (stop.stop_requested()) co_return;
+  if (keep) {
+    query_ = std::move(parsed);
+    found_ = std::move(found);
+  } else {
+    query_.reset();
+    found_.clear();
+  }
+}
+
+std::shared_ptr<const Index::Buffer> Index::Session::KeepLines(
+    std::vector<Match>& matches) {
+  auto buffer = std::make_shared<Buffer>();
+  std::size_t size = 0;
+  for (const Match& m : matches) size += m.line_contents.size();
+  buffer->stored.reserve(size);
+  for (const Match& m : matches) buffer->stored += m.line_contents;
+  const std::string_view lines = buffer->stored;
+  std::size_t offset = 0;
+  for (Match& m : matches) {
+    m.line_contents = lines.substr(offset, m.line_contents.size());
+    offset += m.line_contents.size();
+  }
+  return buffer;
+}
+
+bool Index::Session::Refines(const Query& query) const {
+  if (!query_ || query.files != query_->files ||
+      query.excluded_files != query_->excluded_files) {
+    return false;
+  }
+  const Expression& before = query_->expression;
+  const Expression& after = query.expression;
+  if (before.kind != Expression::Kind::kSequence ||
+      after.kind != Expression::Kind::kSequence ||
+      after.terms.size() < before.terms.size()) {
+    return false;
+  }
+  const std::size_t last = before.terms.size() - 1;
+  for (std::size_t i = 0; i < last; i++) {
+    if (after.terms[i] != before.terms[i]) return false;
+  }
+  return after.terms[last].starts_with(before.terms[last]);
+}
+
+std::optional<Index::Match> Index::MatchLine(
+    const Expression& expression, std::string_view line_contents, int line,
+    std::uint64_t line_offset) noexcept {
+  const std::optional<Expression::Span> span = expression.Match(line_contents);
+  if (!span) return std::nullopt;
+  // Negations match without a column, so report those at the start.
+  const std::size_t column =
+      span->column == line_contents.npos ? 0 : span->column;
+  return Match{.line = line,
+               .column = static_cast<int>(column),
+               .offset = line_offset + column,
+               .length = span->length,
+               .line_contents = line_contents};
+}
+
+void Index::FindMatches(std::string_view text, const Expression& expression,
+                        std::vector<Match>& matches) {
+  matches.clear();
+  const char* const start = text.data();
+  int line = 0;
+  while (!text.empty()) {
+    line++;
+    // Consume a line from the input.
+    auto line_end = text.find('\n');
+    std::string_view line_contents;
+    if (line_end == text.npos) {
+      line_contents = text;
+      text = "";
+    } else {
+      line_contents = text.substr(0, line_end);
+      text.remove_prefix(line_end + 1);
+    }
+    // Remove a trailing '\r' which might be present for Windows files.
+    if (!line_contents.empty() && line_contents.back() == '\r') {
+      line_contents.remove_suffix(1);
+    }
+    // Check for a match.
+    if (auto match = MatchLine(expression, line_contents, line,
+                               line_contents.data() - start)) {
+      matches.push_back(*match);
     }
   }
 }
 
-std::vector<std::string> Index::Terms(std::string_view query) noexcept {
-  std::vector<std::string> terms;
-  const char* i = query.data();
-  const char* const end = i + query.size();
+bool Index::Verifier::Next(FileMatches& found) {
   while (true) {
-    while (i != end && *i == ' ') i++;
-    if (i == end) break;
-    std::string& term = terms.emplace_back();
-    while (true) {
-      if (i == end || *i == ' ') break;
-      if (*i == '\\' && i + 1 != end) i++;
-      term.push_back(*i);
-      i++;
+    if (next_file_ == files_.size()) {
+      // Move on to the next content.
+      if (next_candidate_ == candidates_.size() || stop_.stop_requested()) {
+        return false;
+      }
+      content_ = candidates_[next_candidate_++];
+      files_ = index_.GetContentFiles(content_);
+      next_file_ = 0;
+      stored_ = live_ = nullptr;
+      tried_stored_ = false;
+      continue;
+    }
+    const FileID file = files_[next_file_++];
+    if (!index_.IsLive(file) ||
+        (allowed_ && !std::ranges::binary_search(*allowed_, file))) {
+      continue;
+    }
+    found.file_name = index_.GetFileName(file);
+    const bool fresh = index_.IsFresh(file);
+    if (fresh && !tried_stored_) {
+      tried_stored_ = true;
+      auto buffer = std::make_shared<Buffer>();
+      if (index_.GetStoredContents(content_, buffer->stored)) {
+        FindMatches(buffer->Contents(), expression_, stored_matches_);
+        stored_ = std::move(buffer);
+      }
     }
+    if (fresh && stored_) {
+      found.buffer = stored_;
+      found.matches = stored_matches_;
+    } else {
+      // Without stored contents, the files are assumed to still be identical
+      // so any of them will do for verification. Otherwise, stale files may
+      // have diverged and are each checked separately.
+      if (!live_ || !index_.stored_.empty()) {
+        const std::span<const FileID> sources =
+            index_.stored_.empty() ? std::span<const FileID>(files_)
+                                     : std::span<const FileID>(&file, 1);
+        auto buffer = std::make_shared<Buffer>();
+        for (FileID source : sources) {
+          try {
+            buffer->file = MemoryMappedFile(index_.GetFileName(source));
+            break;
+          } catch (std::exception&) {}
+        }
+        FindMatches(buffer->Contents(), expression_, live_matches_);
+        live_ = std::move(buffer);
+      }
+      found.buffer = live_;
+      found.matches = live_matches_;
+    }
+    if (!found.matches.empty()) return true;
   }
-  return terms;
 }
 
-std::vector<Index::FileID> Index::Candidates(
-    std::span<const std::string> terms) const noexcept {
-  bool first = true;
-  std::vector<FileID> candidates;
-  for (std::string_view term : terms) {
-    for (auto trigram : std::ranges::views::slide(term, 3)) {
-      const int id = Hash(std::string_view(trigram));
-      if (first) {
-        first = false;
-        candidates.assign_range(GetSnippets(id));
+std::generator<std::string_view> Index::SearchFiles(
+    std::string_view query) const noexcept {
+  const Query parsed = Query::Parse(query);
+  const Expression& expression = parsed.expression;
+  for (const Index* layer : Layers()) {
+    std::optional<std::vector<FileID>> files = layer->FilterFiles(parsed);
+    if (!expression.empty()) {
+      std::optional<std::vector<FileID>> plan =
+          layer->Plan(expression, Table::kNames);
+      if (!plan) {
+        plan.emplace(std::from_range,
+                     std::views::iota(FileID(0), FileID(layer->files_.size())));
+      }
+      if (files) {
+        std::vector<FileID> both;
+        std::ranges::set_intersection(*files, *plan, std::back_inserter(both));
+        *files = std::move(both);
       } else {
-        int i = 0, j = 0;
-        const int n = (int)candidates.size();
-        for (FileID f : GetSnippets(id)) {
-          if (i == n) break;
-          while (i < n && candidates[i] < f) i++;
-          if (i < n && candidates[i] == f) candidates[j++] = candidates[i++];
+        files = std::move(plan);
+      }
+    }
+    if (!files) continue;
+    for (FileID file : *files) {
+      if (!layer->IsLive(file)) continue;
+      if (expression.Match(layer->GetRelativeName(file))) {
+        co_yield layer->GetFileName(file);
+      }
+    }
+  }
+}
+
+std::optional<std::vector<Index::FileID>> Index::FilterFiles(
+    const Query& query) const {
+  if (query.files.empty() && query.excluded_files.empty()) return std::nullopt;
+  // Use the file name index to narrow down the files which could match.
+  std::vector<int> trigrams;
+  for (std::string_view term : query.files) {
+    for (auto trigram : std::ranges::views::slide(term, 3)) {
+      trigrams.push_back(Hash(std::string_view(trigram)));
+    }
+  }
+  std::vector<FileID> files;
+  if (trigrams.empty()) {
+    files.assign_range(std::views::iota(FileID(0), FileID(files_.size())));
+  } else {
+    files = Intersection(Table::kNames, trigrams);
+  }
+  // The paths are in memory, so check the candidates precisely.
+  std::erase_if(files, [&](FileID file) {
+    const std::string_view name = GetRelativeName(file);
+    const auto contains = [&](std::string_view term) {
+      return name.contains(term);
+    };
+    return !std::ranges::all_of(query.files, contains) ||
+           std::ranges::any_of(query.excluded_files, contains);
+  });
+  return files;
+}
+
+std::optional<std::vector<std::uint32_t>> Index::Plan(
+    const Expression& expression, Table table, std::stop_token stop) const {
+  std::optional<std::vector<std::uint32_t>> result;
+  switch (expression.kind) {
+    case Expression::Kind::kSequence: {
+      // Intersect the posting lists for every trigram. Shorter terms use the
+      // lists for single bytes or pairs of bytes, which only file contents
+      // have.
+      std::vector<int> trigrams;
+      for (std::string_view term : expression.terms) {
+        if (table == Table::kSnippets && !sparse_.empty() && term.size() > 3) {
+          // A few long grams are more selective than all of the trigrams.
+          for (std::string_view gram : CoveringGrams(term)) {
+            trigrams.push_back(gram.size() == 3 ? Hash(gram)
+                                                : SparseHash(gram));
+          }
+          continue;
+        }
+        for (auto trigram : std::ranges::views::slide(term, 3)) {
+          trigrams.push_back(Hash(std::string_view(trigram)));
+        }
+        if (!term.empty() && term.size() < 3 && table == Table::kSnippets) {
+          trigrams.push_back(ShortHash(term));
         }
-        candidates.resize(j);
       }
+      if (!trigrams.empty()) result = Intersection(table, trigrams);
+      return result;
     }
+    case Expression::Kind::kAnd:
+      for (const Expression& child : expression.children) {
+        if (stop.stop_requested()) return std::nullopt;
+        std::optional<std::vector<std::uint32_t>> ids =
+            Plan(child, table, stop);
+        if (!ids) continue;
+        if (!result) {
+          result = std::move(ids);
+        } else {
+          std::vector<std::uint32_t> both;
+          std::ranges::set_intersection(*result, *ids,
+                                        std::back_inserter(both));
+          *result = std::move(both);
+        }
+      }
+      return result;
+    case Expression::Kind::kOr:
+      result.emplace();
+      for (const Expression& child : expression.children) {
+        if (stop.stop_requested()) return std::nullopt;
+        std::optional<std::vector<std::uint32_t>> ids =
+            Plan(child, table, stop);
+        // If any alternative is unconstrained, so is the union.
+        if (!ids) return std::nullopt;
+        std::vector<std::uint32_t> either;
+        std::ranges::set_union(*result, *ids, std::back_inserter(either));
+        *result = std::move(either);
+      }
+      return result;
+    case Expression::Kind::kNot:
+      // Negations apply per line: a file containing the term can still have
+      // lines without it, so negations cannot narrow down the candidates.
+      return std::nullopt;
+  }
+  return std::nullopt;
+}
+
+std::vector<Index::ContentID> Index::Candidates(
+    const Expression& expression,
+    const std::optional<std::vector<FileID>>& files,
+    std::stop_token stop) const noexcept {
+  // Without a plan (e.g. for a negation) any content could match.
+  std::optional<std::vector<ContentID>> plan =
+      Plan(expression, Table::kSnippets, stop);
+  if (stop.stop_requested()) return {};
+  std::vector<ContentID> candidates;
+  if (files) {
+    // Only keep contents which belong to at least one of the allowed files.
+    std::vector<ContentID> allowed;
+    allowed.reserve(files->size());
+    for (FileID file : *files) allowed.push_back(GetFileContent(file));
+    std::ranges::sort(allowed);
+    allowed.erase(std::ranges::unique(allowed).begin(), allowed.end());
+    if (plan) {
+      std::ranges::set_intersection(*plan, allowed,
+                                    std::back_inserter(candidates));
+    } else {
+      candidates = std::move(allowed);
+    }
+  } else if (plan) {
+    candidates = std::move(*plan);
+  } else {
+    candidates.assign_range(
+        std::views::iota(ContentID(0), ContentID(contents_.size())));
   }
   // Sort candidates by the length of the shared common path prefix with the
-  // current working directory.
+  // current working directory, using the closest file for shared contents.
   const fs::path here = fs::current_path();
   auto distance = [this, here](FileID id) -> int {
     const fs::path path = GetFileName(id);
     auto [l, r] = std::ranges::mismatch(path, here);
     return std::distance(path.begin(), l);
   };
-  std::ranges::stable_sort(candidates, std::greater<>(), distance);
+  std::vector<std::pair<int, ContentID>> keyed;
+  keyed.reserve(candidates.size());
+  for (ContentID content : candidates) {
+    // Short terms and negations make nearly every content a candidate, so this
+    // can take a while.
+    if (stop.stop_requested()) return {};
+    int best = 0;
+    for (FileID file : GetContentFiles(content)) {
+      best = std::max(best, distance(file));
+    }
+    keyed.emplace_back(best, content);
+  }
+  std::ranges::stable_sort(keyed, std::greater<>(),
+                           &std::pair<int, ContentID>::first);
+  for (std::size_t i = 0; i < keyed.size(); i++) {
+    candidates[i] = keyed[i].second;
+  }
   return candidates;
 }
 
@@ -350,23 +1562,339 @@ std::string_view Index::GetFileName(FileID id) const {
   return std::string_view(p, length);
 }
 
-std::generator<Index::FileID> Index::GetSnippets(int id) const {
-  const char* p = data_.data() + snippets_[id];
+std::string_view Index::GetRelativeName(FileID id) const {
+  return RelativeName(GetFileName(id), root_);
+}
+
+std::string_view Index::GetTombstone(std::size_t index) const {
+  const char* p = data_.data() + tombstones_[index];
+  std::uint64_t length;
+  p = ReadVarUint64(p, length);
+  return std::string_view(p, length);
+}
+
+Index::ContentID Index::GetFileContent(FileID id) const {
+  const char* p = data_.data() + files_[id];
   std::uint64_t length;
   p = ReadVarUint64(p, length);
+  std::uint64_t content;
+  ReadVarUint64(p + length, content);
+  return ContentID(content);
+}
+
+std::vector<Index::FileID> Index::GetContentFiles(ContentID id) const {
+  const char* p = data_.data() + contents_[id];
+  std::uint64_t length;
+  p = ReadVarUint64(p, length);
+  std::vector<FileID> files(length);
   FileID file_id = 0;
-  for (std::uint64_t i = 0; i < length; i++) {
+  for (FileID& file : files) {
     std::uint64_t value;
     p = ReadVarUint64(p, value);
     file_id += FileID(value);
-    co_yield file_id;
+    file = file_id;
+  }
+  return files;
+}
+
+bool Index::IsFresh(FileID id) const {
+  if (stored_.empty()) return false;
+  const std::uint64_t time = ModifiedTime(fs::path(GetFileName(id)));
+  return time != 0 && time == modified_[id];
+}
+
+bool Index::GetStoredContents(ContentID id, std::string& output) const {
+  output.clear();
+  if (stored_.empty()) return false;
+  try {
+    const char* p = data_.data() + stored_[id];
+    std::uint64_t size;
+    p = ReadVarUint64(p, size);
+    while (output.size() < size) {
+      std::uint64_t compressed;
+      p = ReadVarUint64(p, compressed);
+      const std::size_t block =
+          std::min<std::uint64_t>(size - output.size(), kStoredBlockSize);
+      Decompress(std::string_view(p, compressed), block, output);
+      p += compressed;
+    }
+    return true;
+  } catch (std::exception&) {
+    output.clear();
+    return false;
+  }
+}
+
+std::string_view Index::GetStoredBlob(ContentID id) const {
+  const char* const start = data_.data() + stored_[id];
+  std::uint64_t size;
+  const char* p = ReadVarUint64(start, size);
+  for (std::uint64_t i = 0; i < size; i += kStoredBlockSize) {
+    std::uint64_t compressed;
+    p = ReadVarUint64(p, compressed);
+    p += compressed;
   }
+  return std::string_view(start, p);
+}
+
+std::vector<std::uint32_t> Index::Intersection(
+    Table table, std::span<const int> trigrams) const {
+  PostingCache& cache = this->cache();
+  const auto key = [&](std::size_t n) {
+    PostingCache::Key key{.layer = generation_,
+                          .table = int(table),
+                          .trigrams = {trigrams.begin(), trigrams.begin() + n}};
+    std::ranges::sort(key.trigrams);
+    key.trigrams.erase(std::ranges::unique(key.trigrams).begin(),
+                       key.trigrams.end());
+    return key;
+  };
+  // Find the longest prefix which has already been intersected. Refining
+  // a query usually extends the previous one, so this is often all but the
+  // last few trigrams.
+  std::vector<std::uint32_t> result;
+  std::size_t done = 0;
+  for (std::size_t n = trigrams.size(); n > 1 && done == 0; n--) {
+    if (PostingCache::Value cached = cache.Find(key(n))) {
+      result = *cached;
+      done = n;
+    }
+  }
+  // A single list is counted by GetPostingList() instead.
+  if (trigrams.size() > 1) cache.Count(done == trigrams.size());
+  if (done == 0) {
+    result = *GetPostingList(table, trigrams.front());
+    done = 1;
+  }
+  if (done == trigrams.size()) return result;
+  for (std::size_t i = done; i < trigrams.size() && !result.empty(); i++) {
+    // Lists which are already decoded are cheaper to walk, but the rest are
+    // only needed for this intersection so are not decoded in full.
+    const PostingCache::Key single{
+        .layer = generation_, .table = int(table), .trigrams = {trigrams[i]}};
+    if (PostingCache::Value cached = cache.Find(single)) {
+      Intersect(result, *cached);
+    } else {
+      Intersect(result, GetPostings(table, trigrams[i]));
+    }
+  }
+  cache.Insert(key(trigrams.size()),
+               std::make_shared<const std::vector<std::uint32_t>>(result));
+  return result;
+}
+
+PostingCache::Value Index::GetPostingList(Table table, int trigram) const {
+  PostingCache& cache = this->cache();
+  PostingCache::Key key{
+      .layer = generation_, .table = int(table), .trigrams = {trigram}};
+  PostingCache::Value cached = cache.Find(key);
+  cache.Count(cached != nullptr);
+  if (cached) return cached;
+  PostingCursor cursor = GetPostings(table, trigram);
+  std::vector<std::uint32_t> ids;
+  ids.reserve(cursor.size());
+  for (; !cursor.done(); cursor.Next()) ids.push_back(cursor.value());
+  auto list = std::make_shared<const std::vector<std::uint32_t>>(
+      std::move(ids));
+  cache.Insert(std::move(key), list);
+  return list;
+}
+
+PostingCursor Index::GetPostings(Table table, int id) const {
+  if (table == Table::kNames) return GetPostings(names_[id]);
+  if (id < kNumPostingLists) return GetPostings(snippets_[id]);
+  return GetPostings(sparse_[id - kNumPostingLists]);
+}
+
+void Index::Merge(std::string_view path) const {
+  constexpr std::uint32_t kRemoved = std::numeric_limits<std::uint32_t>::max();
+  std::vector<const Index*> layers = Layers();
+  std::ranges::reverse(layers);
+  // Every live file, in order of path.
+  struct Source {
+    std::string_view name;
+    std::size_t layer;
+    FileID file;
+  };
+  std::vector<Source> sources;
+  for (std::size_t i = 0; i < layers.size(); i++) {
+    for (FileID f = 0; f < layers[i]->files_.size(); f++) {
+      if (!layers[i]->IsLive(f)) continue;
+      sources.push_back(
+          {.name = layers[i]->GetFileName(f), .layer = i, .file = f});
+    }
+  }
+  std::ranges::sort(sources, {}, &Source::name);
+  // file_ids[i][f] is the new FileID for file f in layer i.
+  std::vector<std::vector<FileID>> file_ids(layers.size());
+  for (std::size_t i = 0; i < layers.size(); i++) {
+    file_ids[i].assign(layers[i]->files_.size(), kRemoved);
+  }
+  std::vector<std::string> files;
+  for (FileID f = 0; f < sources.size(); f++) {
+    file_ids[sources[f].layer][sources[f].file] = f;
+    files.emplace_back(sources[f].name);
+  }
+  // Contents are only stored if every layer stores them.
+  const bool store = std::ranges::all_of(layers, [](const Index* layer) {
+    return layer->contents_.empty() || !layer->stored_.empty();
+  });
+  std::vector<std::uint64_t> modified(files.size());
+  // Renumber the contents which are still in use, layer by layer, so that
+  // remapping the sorted posting lists of each layer in turn keeps them sorted.
+  // content_ids[i][c] is the new ContentID for content c in layer i.
+  std::vector<std::vector<ContentID>> content_ids(layers.size());
+  std::vector<std::vector<FileID>> contents;
+  std::vector<std::string> stored;
+  for (std::size_t i = 0; i < layers.size(); i++) {
+    const Index& layer = *layers[i];
+    content_ids[i].assign(layer.contents_.size(), kRemoved);
+    for (ContentID c = 0; c < layer.contents_.size(); c++) {
+      std::vector<FileID> list;
+      for (FileID f : layer.GetContentFiles(c)) {
+        const FileID file = file_ids[i][f];
+        if (file == kRemoved) continue;
+        list.push_back(file);
+        modified[file] = layer.modified_[f];
+      }
+      if (list.empty()) continue;
+      std::ranges::sort(list);
+      content_ids[i][c] = ContentID(contents.size());
+      contents.push_back(std::move(list));
+      if (store) stored.emplace_back(layer.GetStoredBlob(c));
+    }
+  }
+  // Likewise for sparse grams.
+  const bool sparse = std::ranges::all_of(layers, [](const Index* layer) {
+    return layer->contents_.empty() || !layer->sparse_.empty();
+  });
+  auto snippets = std::make_unique<SnippetTable>(
+      sparse ? kNumPostingLists + kNumSparseGrams : kNumPostingLists);
+  for (int id = 0; id < int(snippets->size()); id++) {
+    for (std::size_t i = 0; i < layers.size(); i++) {
+      if (layers[i]->contents_.empty()) continue;
+      for (PostingCursor cursor =
+               layers[i]->GetPostings(Table::kSnippets, id);
+           !cursor.done(); cursor.Next()) {
+        const ContentID c = cursor.value();
+        if (content_ids[i][c] != kRemoved) {
+          (*snippets)[id].push_back(content_ids[i][c]);
+        }
+      }
+    }
+  }
+  auto indexer = std::make_unique<Indexer>(path);
+  indexer->Assign(std::move(files), std::move(contents), std::move(stored),
+                  std::move(modified), std::move(snippets));
+  indexer->SetGeneration(generation(), {});
+  indexer->Save();
 }
 
 void Build(std::string_view path) {
-  auto indexer = std::make_unique<Indexer>();
+  // The new index includes every change which has been made so far, so any
+  // existing segments are obsolete.
+  const std::vector<std::uint64_t> segments = FindSegments(path);
+  const std::uint64_t generation = segments.empty() ? 0 : segments.back();
+  auto indexer = std::make_unique<Indexer>(path);
   indexer->IndexAll();
-  indexer->Save(path);
+  indexer->SetGeneration(generation, {});
+  indexer->Save();
+  RemoveSegments(path, generation);
+}
+
+std::string SegmentPath(std::string_view path, std::uint64_t generation) {
+  return std::format("{}.{}", path, generation);
+}
+
+std::vector<std::uint64_t> FindSegments(std::string_view path) {
+  const fs::path base(path);
+  const std::string prefix = base.filename().string() + ".";
+  fs::path directory = base.parent_path();
+  if (directory.empty()) directory = ".";
+  std::vector<std::uint64_t> generations;
+  std::error_code error;
+  for (auto i = fs::directory_iterator(directory, error);
+       !error && i != fs::directory_iterator(); i.increment(error)) {
+    const std::string name = i->path().filename().string();
+    if (!name.starts_with(prefix) || name.size() == prefix.size()) continue;
+    const char* const end = name.data() + name.size();
+    std::uint64_t generation;
+    const auto [p, result] =
+        std::from_chars(name.data() + prefix.size(), end, generation);
+    if (result == std::errc() && p == end) generations.push_back(generation);
+  }
+  std::ranges::sort(generations);
+  return generations;
+}
+
+void BuildSegment(std::string_view path, std::uint64_t generation,
+                  std::vector<std::string> files,
+                  std::vector<std::string> deleted) {
+  const Policy policy = Policy::Load(fs::current_path() / ".jcspolicy");
+  std::ranges::sort(files);
+  // The new versions of the files replace the old ones even if the policy now
+  // skips them.
+  std::vector<std::string> tombstones = files;
+  tombstones.append_range(deleted);
+  auto indexer = std::make_unique<Indexer>(SegmentPath(path, generation));
+  indexer->IndexFiles(policy, std::move(files), {});
+  indexer->SetGeneration(generation, std::move(tombstones));
+  indexer->Save();
+}
+
+void FindChanges(std::string_view path, std::vector<std::string>& files,
+                 std::vector<std::string>& deleted) {
+  const Policy policy = Policy::Load(fs::current_path() / ".jcspolicy");
+  SkippedFiles skipped;
+  std::vector<std::string> found = Indexer::DiscoverFiles(policy, skipped);
+  // The index and the files written next to it are never indexed.
+  const std::string prefix = fs::absolute(path).string();
+  std::erase_if(found, [&](const std::string& file) {
+    return file.starts_with(prefix);
+  });
+  const Index index(path);
+  // The modification time of every live file when it was indexed, in order of
+  // path.
+  std::vector<std::pair<std::string_view, std::uint64_t>> indexed;
+  for (const Index* layer : index.Layers()) {
+    for (Index::FileID f = 0; f < layer->files_.size(); f++) {
+      if (layer->IsLive(f)) {
+        indexed.emplace_back(layer->GetFileName(f), layer->modified_[f]);
+      }
+    }
+  }
+  std::ranges::sort(indexed);
+  // Files which the policy skipped based on their contents are not in the
+  // index, so they are always reported and checked again.
+  auto i = indexed.begin();
+  for (const std::string& file : found) {
+    for (; i != indexed.end() && i->first < file; ++i) {
+      deleted.emplace_back(i->first);
+    }
+    if (i == indexed.end() || i->first != file) {
+      files.push_back(file);
+      continue;
+    }
+    const std::uint64_t time = ModifiedTime(file);
+    if (time == 0 || time != i->second) files.push_back(file);
+    ++i;
+  }
+  for (; i != indexed.end(); ++i) deleted.emplace_back(i->first);
+}
+
+void Compact(std::string_view path) {
+  // Windows cannot replace a file which is mapped, so the merged index is
+  // written under another name and only moved into place once the old one has
+  // been unmapped.
+  const std::string merged = std::format("{}.compact", path);
+  std::uint64_t generation;
+  {
+    const Index index(path);
+    generation = index.generation();
+    index.Merge(merged);
+  }
+  fs::rename(merged, path);
+  RemoveSegments(path, generation);
 }
 
 }  // namespace jcs
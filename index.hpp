@@ -2,22 +2,118 @@
 #define INDEX_HPP_
 
 #include "platform/memory_mapped_file.hpp"
+#include "posting_cache.hpp"
+#include "query.hpp"
+#include "serial.hpp"
 
+#include <array>
+#include <cstdint>
+#include <functional>
 #include <generator>
+#include <memory>
+#include <optional>
+#include <stop_token>
 #include <string>
 #include <string_view>
+#include <utility>
 #include <vector>
 #include <mutex>
 
 namespace jcs {
 
 inline constexpr int kNumSnippets = 1 << 16;
+// Every single byte and pair of bytes also has a posting list of its own, so
+// that terms which are too short for a trigram can still narrow down a search.
+// These come after the trigram lists.
+inline constexpr int kNumShortSnippets = 256 + (1 << 16);
+inline constexpr int kNumPostingLists = kNumSnippets + kNumShortSnippets;
+// Indices which include sparse grams (see SparseGrams) hash them into this
+// many more posting lists, which come after all of the others.
+inline constexpr int kNumSparseGrams = 1 << 18;
+inline constexpr std::size_t kMaxSparseGramLength = 32;
+inline constexpr std::size_t kPostingCacheBytes = 64 << 20;
+inline constexpr std::size_t kMaxSessionBytes = 16 << 20;
 
 int Hash(std::string_view snippet) noexcept;
+// Returns the posting list for a snippet of one or two bytes.
+int ShortHash(std::string_view snippet) noexcept;
+// Returns the posting list for a sparse gram.
+int SparseHash(std::string_view gram) noexcept;
+
+// Calls `gram` with the offset and length of each sparse gram in `text`, in
+// order of where they end. Every pair of
+// adjacent bytes has a fixed weight, and a sparse gram is a substring whose
+// first and last pairs both weigh more than every pair in between. This
+// includes every trigram. Grams longer than kMaxSparseGramLength are omitted.
+//
+// Whether a substring is a sparse gram does not depend on the surrounding
+// text, so the sparse grams of a term are also sparse grams of every file
+// which contains it.
+void SparseGrams(
+    std::string_view text,
+    const std::function<void(std::size_t offset, std::size_t length)>& gram);
+
+// Returns the sparse grams of `term` which are not part of longer ones. Files
+// containing the term contain all of these, and together they cover it.
+std::vector<std::string_view> CoveringGrams(std::string_view term);
+
+// Iterates over a posting list in the index without decoding it up front. The
+// list is stored as a count followed by the delta-encoded IDs.
+class PostingCursor {
+ public:
+  explicit PostingCursor(const char* data) {
+    std::uint64_t size;
+    data_ = ReadVarUint64(data, size);
+    size_ = size;
+    remaining_ = size;
+    Next();
+  }
+
+  // The number of IDs in the list.
+  std::size_t size() const { return size_; }
+
+  // Returns true once the cursor has moved past the last ID.
+  bool done() const { return done_; }
+
+  // The current ID, if not done().
+  std::uint32_t value() const { return value_; }
+
+  // Moves to the next ID.
+  void Next() {
+    if (remaining_ == 0) {
+      done_ = true;
+      return;
+    }
+    remaining_--;
+    // Most deltas fit in a single byte.
+    if ((*data_ & 1) == 0) {
+      value_ += std::uint8_t(*data_++) >> 1;
+    } else {
+      std::uint64_t delta;
+      data_ = ReadVarUint64(data_, delta);
+      value_ += std::uint32_t(delta);
+    }
+  }
+
+  // Moves to the first ID which is at least `target`.
+  void AdvanceTo(std::uint32_t target) {
+    while (!done_ && value_ < target) Next();
+  }
+
+ private:
+  const char* data_;
+  std::size_t size_;
+  std::size_t remaining_;
+  std::uint32_t value_ = 0;
+  bool done_ = false;
+};
 
 class Index {
  public:
   using FileID = std::uint32_t;
+  // Files with byte-identical contents share a single ContentID. Posting lists
+  // are keyed by ContentID so that duplicated files are only verified once.
+  using ContentID = std::uint32_t;
 
   Index() = default;
   explicit Index(std::string_view path);
@@ -36,28 +132,340 @@ class Index {
   struct SearchResult {
     std::string_view file_name;
     int line, column;
+    // The position of the match in the file, in bytes, and its length.
+    std::uint64_t offset;
+    std::size_t length;
     std::string_view line_contents;
   };
 
   std::generator<SearchResult> Search(std::string_view query) const noexcept;
 
+  // Calls `callback` with each result until it returns false. Unlike the
+  // generator above, this does not resume a coroutine for every result.
+  void Search(std::string_view query,
+              const std::function<bool(const SearchResult&)>& callback) const;
+
+  // Search for files whose paths match the query.
+  std::generator<std::string_view> SearchFiles(
+      std::string_view query) const noexcept;
+
+  // Searches as a query is typed, reusing earlier results where possible.
+  class Session;
+
+  // Counters for the cache of decoded posting lists.
+  PostingCache::Stats CacheStats() const { return cache_.stats(); }
+
+  // The newest generation of changes which the index includes. Each delta
+  // segment is a new generation.
+  std::uint64_t generation() const;
+
+  // Statistics about the base index, for judging how well the hash table size
+  // and the indexing policy suit a repository.
+  struct Info {
+    // The size of one part of the index file.
+    struct Section {
+      std::string_view name;
+      std::uint64_t bytes;
+    };
+    // Totals for one kind of posting list.
+    struct Lists {
+      std::string_view name;
+      std::size_t lists = 0, non_empty = 0;
+      std::uint64_t postings = 0, bytes = 0;
+    };
+    std::uint64_t generation = 0;
+    std::size_t files = 0, contents = 0, stored = 0, tombstones = 0;
+    // Delta segments which have not been compacted yet.
+    std::size_t segments = 0;
+    std::uint64_t segment_bytes = 0;
+    std::vector<Section> sections;
+    std::vector<Lists> lists;
+    // histogram[i] counts the trigram lists whose length needs i bits, i.e.
+    // lengths in [2^(i-1), 2^i).
+    std::array<std::size_t, 33> histogram = {};
+    // The trigram buckets with the longest posting lists, and their lengths.
+    std::vector<std::pair<int, std::uint64_t>> heaviest;
+  };
+
+  // Reads the statistics from the tables, without decoding any posting lists.
+  Info GetInfo() const;
+
  private:
-  static std::vector<std::string> Terms(std::string_view query) noexcept;
+  // The posting list tables in the index.
+  enum class Table {
+    kSnippets,  // ContentIDs for trigrams of the file contents.
+    kNames,     // FileIDs for trigrams of the file names.
+  };
+
+  struct Match {
+    int line, column;
+    std::uint64_t offset;
+    std::size_t length;
+    std::string_view line_contents;
+  };
+
+  // The contents of a file, either mapped from disk or decompressed from the
+  // index.
+  struct Buffer {
+    std::string_view Contents() const {
+      return stored.empty() ? file.Contents() : std::string_view(stored);
+    }
+
+    MemoryMappedFile file;
+    std::string stored;
+  };
+
+  // The matches in a single file. The line contents refer to `buffer`, which
+  // may be shared between files with identical contents.
+  struct FileMatches {
+    std::string_view file_name;
+    std::shared_ptr<const Buffer> buffer;
+    std::vector<Match> matches;
+  };
+
+  friend void Build(std::string_view path);
+  friend void Compact(std::string_view path);
+  friend void FindChanges(std::string_view path,
+                          std::vector<std::string>& files,
+                          std::vector<std::string>& deleted);
+
+  // Loads a single base index or segment.
+  void LoadFile(std::string_view path);
+
+  // The base index and its segments, newest first.
+  std::vector<const Index*> Layers() const;
+
+  // Writes the base index merged with its segments to `path`.
+  void Merge(std::string_view path) const;
+
+  // Returns false if a newer segment replaces or deletes the file.
+  bool IsLive(FileID id) const {
+    return superseded_.empty() || !superseded_[id];
+  }
+
+  // Checks a line which starts `line_offset` bytes into the file.
+  static std::optional<Match> MatchLine(const Expression& expression,
+                                        std::string_view line_contents,
+                                        int line,
+                                        std::uint64_t line_offset) noexcept;
+  static SearchResult ToResult(std::string_view file_name,
+                               const Match& match) noexcept {
+    return {.file_name = file_name,
+            .line = match.line,
+            .column = match.column,
+            .offset = match.offset,
+            .length = match.length,
+            .line_contents = match.line_contents};
+  }
+
+  // Finds every line of `text` which matches `expression`.
+  static void FindMatches(std::string_view text, const Expression& expression,
+                          std::vector<Match>& matches);
 
-  std::vector<FileID> Candidates(
-      std::span<const std::string> terms) const noexcept;
+  // Checks each candidate in turn, producing the matches for every live file
+  // with at least one match.
+  class Verifier;
+
+  // Finds the candidates for a query in each layer in turn and verifies them.
+  class Searcher;
+
+  // Returns the files which satisfy the file filters of the query in ascending
+  // order, or nullopt if the query does not filter by file.
+  std::optional<std::vector<FileID>> FilterFiles(const Query& query) const;
+
+  // Evaluates the expression using the posting lists in `table`, producing
+  // a sorted superset of the IDs which can match, or nullopt if the expression
+  // does not narrow them down (e.g. a negation). The result is meaningless if
+  // `stop` is requested.
+  std::optional<std::vector<std::uint32_t>> Plan(
+      const Expression& expression, Table table,
+      std::stop_token stop = {}) const;
+
+  // Intersects the posting lists for `trigrams`, reusing the longest prefix of
+  // them whose intersection is cached.
+  std::vector<std::uint32_t> Intersection(Table table,
+                                          std::span<const int> trigrams) const;
+
+  // Returns the decoded posting list for a trigram, using the cache.
+  PostingCache::Value GetPostingList(Table table, int trigram) const;
+
+  // Returns the contents which may match, closest to the working directory
+  // first. Returns nothing if `stop` is requested.
+  std::vector<ContentID> Candidates(
+      const Expression& expression,
+      const std::optional<std::vector<FileID>>& files,
+      std::stop_token stop = {}) const noexcept;
 
   std::string_view GetFileName(FileID id) const;
-  std::generator<FileID> GetSnippets(int id) const;
+  // The file name below the directory containing the index.
+  std::string_view GetRelativeName(FileID id) const;
+  std::string_view GetTombstone(std::size_t index) const;
+  ContentID GetFileContent(FileID id) const;
+  std::vector<FileID> GetContentFiles(ContentID id) const;
+
+  // Returns true if the index stores the contents of this file and the file
+  // has not been modified since.
+  bool IsFresh(FileID id) const;
+
+  // Decompresses the stored contents into `output`. Returns false if the index
+  // does not store contents.
+  bool GetStoredContents(ContentID id, std::string& output) const;
+
+  // Returns the compressed contents as they are stored in the index.
+  std::string_view GetStoredBlob(ContentID id) const;
+
+  PostingCursor GetPostings(std::uint64_t offset) const {
+    return PostingCursor(data_.data() + offset);
+  }
+  PostingCursor GetPostings(Table table, int id) const;
 
   MemoryMappedFile buffer_;
   std::span<const std::uint64_t> snippets_;
   std::span<const std::uint64_t> files_;
+  std::span<const std::uint64_t> contents_;
+  // Only present when the index stores file contents.
+  std::span<const std::uint64_t> stored_;
+  // The modification time of each file when it was indexed.
+  std::span<const std::uint64_t> modified_;
+  // Posting lists of FileIDs for the trigrams in each file name.
+  std::span<const std::uint64_t> names_;
+  // Paths whose versions in earlier generations are replaced or deleted.
+  std::span<const std::uint64_t> tombstones_;
+  // Posting lists of ContentIDs for the sparse grams in each file, if the
+  // index includes them.
+  std::span<const std::uint64_t> sparse_;
   std::span<const char> data_;
+  std::uint64_t generation_ = 0;
+  // The directory containing the index, which file filters are relative to.
+  std::string root_;
+
+  // Segments with changes made after the base index was built, oldest first.
+  std::vector<std::unique_ptr<Index>> segments_;
+  // superseded_[f] is true if file f is replaced or deleted by a newer
+  // segment. Empty if there are no newer segments.
+  std::vector<bool> superseded_;
+
+  // For segments, the base index. Its cache is shared by every layer so that
+  // they are all within one budget.
+  const Index* base_ = nullptr;
+  // Decoded posting lists and intersections from earlier queries.
+  mutable PostingCache cache_{kPostingCacheBytes};
+
+  PostingCache& cache() const { return base_ ? base_->cache_ : cache_; }
+};
+
+class Index::Verifier {
+ public:
+  // The arguments must outlive the verifier.
+  Verifier(const Index& index, const Expression& expression,
+           std::span<const ContentID> candidates,
+           const std::optional<std::vector<FileID>>& allowed,
+           std::stop_token stop = {})
+      : index_(index),
+        expression_(expression),
+        candidates_(candidates),
+        allowed_(allowed),
+        stop_(std::move(stop)) {}
+
+  // Produces the matches in the next file. Returns false when there are no
+  // more, or if `stop` is requested.
+  bool Next(FileMatches& found);
+
+ private:
+  const Index& index_;
+  const Expression& expression_;
+  std::span<const ContentID> candidates_;
+  const std::optional<std::vector<FileID>>& allowed_;
+  std::stop_token stop_;
+  std::size_t next_candidate_ = 0;
+  // The content being checked and the files which share it.
+  ContentID content_ = 0;
+  std::vector<FileID> files_;
+  std::size_t next_file_ = 0;
+  // The matches in the stored and live contents of the files, which are found
+  // at most once per content.
+  std::shared_ptr<const Buffer> stored_, live_;
+  std::vector<Match> stored_matches_, live_matches_;
+  bool tried_stored_ = false;
+};
+
+class Index::Searcher {
+ public:
+  // The query must outlive the searcher.
+  Searcher(const Index& index, const Query& query, std::stop_token stop = {})
+      : query_(query), stop_(std::move(stop)), layers_(index.Layers()) {}
+
+  // Produces the matches in the next file. Returns false when there are no
+  // more, or if `stop` is requested.
+  bool Next(FileMatches& found);
+
+ private:
+  const Query& query_;
+  std::stop_token stop_;
+  std::vector<const Index*> layers_;
+  std::size_t next_layer_ = 0;
+  // The candidates in the current layer, which `verifier_` refers to.
+  std::optional<std::vector<FileID>> allowed_;
+  std::vector<ContentID> candidates_;
+  std::optional<Verifier> verifier_;
+};
+
+// When a query refines the last completed one (by extending its last term or
+// appending more terms), only the lines which matched before are checked again.
+class Index::Session {
+ public:
+  explicit Session(const Index& index) : index_(index) {}
+
+  // Search for a term, producing results as they are found. If `stop` is
+  // requested, the results are incomplete and are not reused by later
+  // searches. Neither are results whose matched lines take up more than
+  // kMaxSessionBytes.
+  std::generator<SearchResult> Search(std::string_view query,
+                                      std::stop_token stop);
+
+ private:
+  bool Refines(const Query& query) const;
+
+  // Copies the matched lines into a buffer of their own, so that the rest of
+  // the file does not need to stay in memory.
+  static std::shared_ptr<const Buffer> KeepLines(std::vector<Match>& matches);
+
+  const Index& index_;
+  // The last completed query and its results, which only refer to the matched
+  // lines.
+  std::optional<Query> query_;
+  std::vector<FileMatches> found_;
 };
 
 void Build(std::string_view path);
 
+// Changes made after the index at `path` was built are stored alongside it in
+// delta segments named `path.N`, where N is the generation of the changes.
+// Each segment indexes the files which changed and lists the paths whose
+// earlier versions it replaces or deletes. Loading an index loads its
+// segments too, and searches consult all of them.
+std::string SegmentPath(std::string_view path, std::uint64_t generation);
+
+// Returns the generations of the segments for the index at `path`, in
+// ascending order.
+std::vector<std::uint64_t> FindSegments(std::string_view path);
+
+// Writes a segment for the index at `path` which indexes `files` and deletes
+// `deleted`.
+void BuildSegment(std::string_view path, std::uint64_t generation,
+                  std::vector<std::string> files,
+                  std::vector<std::string> deleted);
+
+// Compares the files below the current directory with the index at `path`
+// and its segments. Adds the files which are new or were modified since they
+// were indexed to `files`, and the indexed files which no longer exist to
+// `deleted`.
+void FindChanges(std::string_view path, std::vector<std::string>& files,
+                 std::vector<std::string>& deleted);
+
+// Merges the segments for the index at `path` into the base index.
+void Compact(std::string_view path);
+
 }  // namespace jcs
 
 #endif  // INDEX_HPP_
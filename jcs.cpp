@@ -1,29 +1,60 @@
 ﻿#include "index.hpp"
+#include "platform/terminal.hpp"
+#include "watch.hpp"
 
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <exception>
 #include <filesystem>
+#include <format>
 #include <iostream>
+#include <iterator>
+#include <mutex>
+#include <optional>
 #include <print>
+#include <span>
+#include <stop_token>
 #include <string>
 #include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
 
 namespace {
 
 namespace fs = std::filesystem;
 
+using std::chrono_literals::operator""ms;
+
 struct Options {
   enum class Mode {
     kInfo,         // Enabled by `--info`. Expects no args.
     kIndex,        // Enabled by `--index`. Expects no args.
     kUpdate,       // Enabled by `--update`. Expects no args.
+    kWatch,        // Enabled by `--watch`. Expects no args.
     kInteractive,  // Enabled by `--interactive` (or nothing). Expects no args.
     kSearch,       // Enabled by no options and a single argument.
+    kFiles,        // Enabled by `--files`. Expects a single argument.
+  };
+  // How search results are written out.
+  enum class Format {
+    kText,  // `file:line:column: text`, for people.
+    // Enabled by `--json`. One JSON object per line. Bytes which are not valid
+    // UTF-8 are escaped as `\u00XX`, with the byte value as the code point.
+    kJson,
+    kNull,  // Enabled by `--null`. `file\0line:column:offset:length:text`.
   };
   Mode mode;
+  Format format = Format::kText;
   std::span<char*> args;
 };
 
 Options ParseOptions(int argc, char* argv[]) {
   std::optional<Options::Mode> mode;
+  Options::Format format = Options::Format::kText;
   bool ignore = false;
   int num_args = 1;
   auto set_mode = [&](Options::Mode m) {
@@ -33,6 +64,13 @@ Options ParseOptions(int argc, char* argv[]) {
     }
     mode = m;
   };
+  auto set_format = [&](Options::Format f) {
+    if (format != Options::Format::kText) {
+      std::println(stderr, "Multiple output formats given.");
+      std::exit(1);
+    }
+    format = f;
+  };
   for (int i = 1; i < argc; i++) {
     const std::string_view arg = argv[i];
     if (ignore || !arg.starts_with("--")) argv[num_args++] = argv[i];
@@ -44,8 +82,16 @@ Options ParseOptions(int argc, char* argv[]) {
       set_mode(Options::Mode::kIndex);
     } else if (arg == "--update") {
       set_mode(Options::Mode::kUpdate);
+    } else if (arg == "--watch") {
+      set_mode(Options::Mode::kWatch);
     } else if (arg == "--interactive") {
       set_mode(Options::Mode::kInteractive);
+    } else if (arg == "--files") {
+      set_mode(Options::Mode::kFiles);
+    } else if (arg == "--json") {
+      set_format(Options::Format::kJson);
+    } else if (arg == "--null") {
+      set_format(Options::Format::kNull);
     }
   }
   const auto args = std::span<char*>(argv, num_args).subspan(1);
@@ -55,10 +101,12 @@ Options ParseOptions(int argc, char* argv[]) {
       case Options::Mode::kInfo:
       case Options::Mode::kIndex:
       case Options::Mode::kUpdate:
+      case Options::Mode::kWatch:
       case Options::Mode::kInteractive:
         expected_args = 0;
         break;
       case Options::Mode::kSearch:
+      case Options::Mode::kFiles:
         expected_args = 1;
         break;
     }
@@ -80,7 +128,12 @@ Options ParseOptions(int argc, char* argv[]) {
         std::exit(1);
     }
   }
-  return Options{.mode = *mode, .args = args};
+  if (format != Options::Format::kText && *mode != Options::Mode::kSearch &&
+      *mode != Options::Mode::kFiles) {
+    std::println(stderr, "--json and --null only apply to searches.");
+    std::exit(1);
+  }
+  return Options{.mode = *mode, .format = format, .args = args};
 }
 
 std::optional<fs::path> FindIndex() {
@@ -102,10 +155,113 @@ jcs::Index LoadIndex() {
   return jcs::Index(index->string());
 }
 
-int RunInteractive() {
-  const jcs::Index index = LoadIndex();
-  constexpr int kMaxFileMatches = 5;
-  constexpr int kMaxFiles = 5;
+// Prints statistics about the index at `path` and how well Hash() spreads
+// trigrams over the buckets.
+int PrintInfo(const fs::path& path) {
+  const auto start = std::chrono::steady_clock::now();
+  const jcs::Index index(path.string());
+  const jcs::Index::Info info = index.GetInfo();
+  std::println("Using {}", path.string());
+  std::println("generation {}, {} segments using {} KiB", info.generation,
+               info.segments, info.segment_bytes >> 10);
+  std::println("files: {}, unique contents: {}, stored: {}, tombstones: {}",
+               info.files, info.contents, info.stored, info.tombstones);
+  std::println("\nsections:");
+  for (const jcs::Index::Info::Section& section : info.sections) {
+    std::println("  {:<18}{:>12} KiB", section.name, section.bytes >> 10);
+  }
+  std::println("\nposting lists:    {:>8} {:>9} {:>12} {:>12} {:>9}", "lists",
+               "non-empty", "postings", "bytes", "bytes/id");
+  for (const jcs::Index::Info::Lists& lists : info.lists) {
+    if (lists.lists == 0) continue;
+    const double bytes_per_posting =
+        lists.postings == 0 ? 0 : double(lists.bytes) / lists.postings;
+    std::println("  {:<16}{:>8} {:>9} {:>12} {:>12} {:>9.2f}", lists.name,
+                 lists.lists, lists.non_empty, lists.postings, lists.bytes,
+                 bytes_per_posting);
+  }
+  std::println("\ntrigram list lengths:");
+  for (std::size_t i = 0; i < info.histogram.size(); i++) {
+    if (info.histogram[i] == 0) continue;
+    const std::string range =
+        i <= 1 ? std::format("{}", i)
+               : std::format("{}-{}", 1ull << (i - 1), (1ull << i) - 1);
+    std::println("  {:>24} {:>8}", range, info.histogram[i]);
+  }
+  // Count how many printable trigrams share each bucket. Real text uses far
+  // fewer of them, but the spread shows how evenly Hash() fills the table.
+  std::vector<int> load(jcs::kNumSnippets);
+  std::string trigram(3, ' ');
+  for (char a = ' '; a <= '~'; a++) {
+    for (char b = ' '; b <= '~'; b++) {
+      for (char c = ' '; c <= '~'; c++) {
+        trigram = {a, b, c};
+        load[jcs::Hash(trigram)]++;
+      }
+    }
+  }
+  const auto [fewest, most] = std::ranges::minmax(load);
+  std::println("\nprintable trigrams per bucket: {:.1f} on average, {} to {}",
+               95.0 * 95 * 95 / jcs::kNumSnippets, fewest, most);
+  std::println("\nheaviest trigram buckets:");
+  for (const auto& [bucket, length] : info.heaviest) {
+    std::println("  {:>6} {:>10} postings ({:.0f}% of contents), shared by {} "
+                 "printable trigrams",
+                 bucket, length,
+                 100.0 * length / std::max<std::size_t>(info.contents, 1),
+                 load[bucket]);
+  }
+  const auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::steady_clock::now() - start);
+  std::println("\nread in {}", elapsed);
+  return 0;
+}
+
+constexpr int kMaxFileMatches = 5;
+constexpr int kMaxFiles = 5;
+
+// Formats a summary of the results, listing a limited number of files and
+// matches within each file. Returns nullopt if `stop` is requested before all
+// of the results have been counted.
+std::optional<std::vector<std::string>> Summarize(
+    std::generator<jcs::Index::SearchResult> results,
+    std::stop_token stop = {}) {
+  std::vector<std::string> output;
+  int num_files = 0;
+  int num_file_matches = 0;
+  int num_matches = 0;
+  std::string_view previous_file;
+  for (jcs::Index::SearchResult result : results) {
+    if (stop.stop_requested()) return std::nullopt;
+    num_matches++;
+    if (result.file_name != previous_file) {
+      if (num_files < kMaxFiles) {
+        output.push_back(std::format("{}", result.file_name));
+      } else if (num_files == kMaxFiles) {
+        output.push_back("...");
+      }
+      previous_file = result.file_name;
+      num_files++;
+      num_file_matches = 1;
+    }
+    if (num_files < kMaxFiles) {
+      if (num_file_matches < kMaxFileMatches) {
+        output.push_back(
+            std::format("  {:4d}  {}", result.line, result.line_contents));
+      } else if (num_file_matches == kMaxFileMatches) {
+        output.push_back("  ...");
+      }
+    }
+    num_file_matches++;
+  }
+  if (stop.stop_requested()) return std::nullopt;
+  output.push_back(
+      std::format("{} matches across {} files.", num_matches, num_files));
+  return output;
+}
+
+// Reads one query per line, which works for any input.
+int RunLines(const jcs::Index& index) {
   while (true) {
     std::print("> ");
     std::string query;
@@ -114,54 +270,266 @@ int RunInteractive() {
       std::cout << '\n';
       return 0;
     }
-    int num_files = 0;
-    int num_file_matches = 0;
-    int num_matches = 0;
-    std::string_view previous_file;
-    for (jcs::Index::SearchResult result : index.Search(query)) {
-      num_matches++;
-      if (result.file_name != previous_file) {
-        if (num_files < kMaxFiles) {
-          std::println("{}", result.file_name);
-        } else if (num_files == kMaxFiles) {
-          std::println("...");
-        }
-        previous_file = result.file_name;
-        num_files++;
-        num_file_matches = 1;
+    const auto lines = Summarize(index.Search(query));
+    for (const std::string& line : *lines) std::println("{}", line);
+  }
+}
+
+// Redraws the screen with the prompt at the top and the results below it.
+void Draw(std::string_view query, std::span<const std::string> lines) {
+  std::string output = std::format("\x1b[H\x1b[2J> {}\n", query);
+  for (const std::string& line : lines) {
+    output += line;
+    output += '\n';
+  }
+  // Put the cursor back at the end of the prompt.
+  output += std::format("\x1b[1;{}H", query.size() + 3);
+  std::fwrite(output.data(), 1, output.size(), stdout);
+  std::fflush(stdout);
+}
+
+// Searches as the query is typed. Each key press cancels the search in progress
+// and starts a new one, which reuses the previous results when the query has
+// only been extended.
+int RunIncremental(const jcs::Index& index) {
+  jcs::RawTerminal terminal;
+  jcs::Index::Session session(index);
+  std::string query;
+  std::vector<std::string> shown;
+  std::mutex mutex;
+  // Set by the worker when it completes a search.
+  std::optional<std::vector<std::string>> ready;
+  std::jthread worker;
+  Draw(query, shown);
+  while (true) {
+    std::optional<char> key = terminal.ReadKey(20ms);
+    if (!key) {
+      std::lock_guard lock(mutex);
+      if (ready) {
+        shown = std::move(*ready);
+        ready.reset();
+        Draw(query, shown);
       }
-      if (num_files < kMaxFiles) {
-        if (num_file_matches < kMaxFileMatches) {
-          std::println("  {:4d}  {}", result.line, result.line_contents);
-        } else if (num_file_matches == kMaxFileMatches) {
-          std::println("  ...");
-        }
+      continue;
+    }
+    // Handle all of the keys which are already waiting before searching again.
+    bool changed = false;
+    for (; key; key = terminal.ReadKey(0ms)) {
+      switch (*key) {
+        case '\x03':  // Ctrl-C
+        case '\x04':  // Ctrl-D
+          worker = {};
+          std::print("\x1b[H\x1b[2J");
+          return 0;
+        case '\x7f':  // Backspace
+        case '\b':
+          if (!query.empty()) {
+            query.pop_back();
+            changed = true;
+          }
+          break;
+        case '\x15':  // Ctrl-U
+          query.clear();
+          changed = true;
+          break;
+        case '\x1b':
+          // Ignore escape sequences such as the arrow keys.
+          while (terminal.ReadKey(0ms)) {}
+          break;
+        default:
+          if (std::isprint(static_cast<unsigned char>(*key))) {
+            query.push_back(*key);
+            changed = true;
+          }
+          break;
       }
-      num_file_matches++;
     }
-    std::println("{} matches across {} files.", num_matches, num_files);
+    if (!changed) continue;
+    // Cancel the search in progress and wait for it to stop.
+    worker = {};
+    ready.reset();
+    worker = std::jthread([&session, &mutex, &ready,
+                           query](std::stop_token stop) {
+      auto lines = Summarize(session.Search(query, stop), stop);
+      if (!lines) return;
+      std::lock_guard lock(mutex);
+      ready = std::move(lines);
+    });
+    Draw(query, shown);
   }
 }
 
-int Search(std::string_view query) {
+int RunInteractive() {
   const jcs::Index index = LoadIndex();
-  for (jcs::Index::SearchResult result : index.Search(query)) {
-    std::println("{}:{}:{}: {}",
-                 result.file_name, result.line, result.column,
-                 result.line_contents);
+  const int status =
+      jcs::IsTerminal() ? RunIncremental(index) : RunLines(index);
+  const jcs::PostingCache::Stats stats = index.CacheStats();
+  std::println(stderr,
+               "Posting cache: {} hits, {} misses, {} evictions, "
+               "{} entries using {} KiB.",
+               stats.hits, stats.misses, stats.evictions, stats.entries,
+               stats.bytes >> 10);
+  return status;
+}
+
+// Returns the length of the valid UTF-8 sequence at the start of `text`, or 0
+// if there is none.
+std::size_t Utf8SequenceLength(std::string_view text) {
+  const auto byte = [&](std::size_t i) { return std::uint8_t(text[i]); };
+  std::size_t length;
+  // The allowed range of the second byte, which rules out overlong forms,
+  // surrogates and code points above U+10FFFF.
+  std::uint8_t low = 0x80, high = 0xbf;
+  if (byte(0) < 0x80) {
+    return 1;
+  } else if (byte(0) >= 0xc2 && byte(0) <= 0xdf) {
+    length = 2;
+  } else if (byte(0) >= 0xe0 && byte(0) <= 0xef) {
+    length = 3;
+    if (byte(0) == 0xe0) low = 0xa0;
+    if (byte(0) == 0xed) high = 0x9f;
+  } else if (byte(0) >= 0xf0 && byte(0) <= 0xf4) {
+    length = 4;
+    if (byte(0) == 0xf0) low = 0x90;
+    if (byte(0) == 0xf4) high = 0x8f;
+  } else {
+    return 0;
+  }
+  if (text.size() < length || byte(1) < low || byte(1) > high) return 0;
+  for (std::size_t i = 2; i < length; i++) {
+    if (byte(i) < 0x80 || byte(i) > 0xbf) return 0;
   }
+  return length;
+}
+
+// Collects output in a large buffer which is written out whenever it fills up,
+// rather than formatting and writing out each result on its own. The buffer is
+// reused, so it only allocates when a single result does not fit.
+class Output {
+ public:
+  static constexpr std::size_t kBufferSize = 1 << 20;
+
+  Output() { buffer_.reserve(kBufferSize); }
+  ~Output() { Flush(); }
+
+  Output(const Output&) = delete;
+  Output& operator=(const Output&) = delete;
+
+  void Write(std::string_view text) {
+    buffer_ += text;
+    if (buffer_.size() >= kBufferSize) Flush();
+  }
+
+  template <typename... Args>
+  void Print(std::format_string<Args...> format, Args&&... args) {
+    std::format_to(std::back_inserter(buffer_), format,
+                   std::forward<Args>(args)...);
+    if (buffer_.size() >= kBufferSize) Flush();
+  }
+
+  // Writes `text` as a quoted JSON string. Valid UTF-8 is passed through as
+  // it is, and any other byte is escaped as the code point with its value, so
+  // that the output is always valid.
+  void WriteJsonString(std::string_view text) {
+    buffer_ += '"';
+    while (!text.empty()) {
+      const auto special = std::ranges::find_if(text, [](char c) {
+        return c == '"' || c == '\\' || std::uint8_t(c) < 0x20 ||
+               std::uint8_t(c) >= 0x80;
+      });
+      buffer_.append(text.begin(), special);
+      text.remove_prefix(special - text.begin());
+      if (text.empty()) break;
+      const char c = text.front();
+      const std::size_t length = Utf8SequenceLength(text);
+      if (c == '"' || c == '\\') {
+        buffer_ += '\\';
+        buffer_ += c;
+      } else if (c == '\t') {
+        buffer_ += "\\t";
+      } else if (length > 1) {
+        buffer_.append(text.substr(0, length));
+      } else {
+        std::format_to(std::back_inserter(buffer_), "\\u{:04x}",
+                       std::uint8_t(c));
+      }
+      text.remove_prefix(std::max<std::size_t>(length, 1));
+    }
+    buffer_ += '"';
+    if (buffer_.size() >= kBufferSize) Flush();
+  }
+
+  void Flush() {
+    std::fwrite(buffer_.data(), 1, buffer_.size(), stdout);
+    std::fflush(stdout);
+    buffer_.clear();
+  }
+
+ private:
+  std::string buffer_;
+};
+
+int Search(std::string_view query, Options::Format format) {
+  const jcs::Index index = LoadIndex();
+  Output output;
+  index.Search(query, [&](const jcs::Index::SearchResult& result) {
+    switch (format) {
+      case Options::Format::kText:
+        output.Print("{}:{}:{}: {}\n", result.file_name, result.line,
+                     result.column, result.line_contents);
+        break;
+      case Options::Format::kJson:
+        output.Write("{\"file\":");
+        output.WriteJsonString(result.file_name);
+        output.Print(",\"line\":{},\"column\":{},\"offset\":{},\"length\":{},"
+                     "\"text\":",
+                     result.line, result.column, result.offset, result.length);
+        output.WriteJsonString(result.line_contents);
+        output.Write("}\n");
+        break;
+      case Options::Format::kNull:
+        // File names may contain ':', so they end with NUL instead. The line
+        // comes last, and never contains '\n'.
+        // A format string cannot contain NUL, so write it separately.
+        output.Write(result.file_name);
+        output.Write(std::string_view("\0", 1));
+        output.Print("{}:{}:{}:{}:{}\n", result.line, result.column,
+                     result.offset, result.length, result.line_contents);
+        break;
+    }
+    return true;
+  });
   return 0;
 }
 
-}  // namespace
+int SearchFiles(std::string_view query, Options::Format format) {
+  const jcs::Index index = LoadIndex();
+  Output output;
+  for (std::string_view file_name : index.SearchFiles(query)) {
+    switch (format) {
+      case Options::Format::kText:
+        output.Print("{}\n", file_name);
+        break;
+      case Options::Format::kJson:
+        output.Write("{\"file\":");
+        output.WriteJsonString(file_name);
+        output.Write("}\n");
+        break;
+      case Options::Format::kNull:
+        output.Write(file_name);
+        output.Write(std::string_view("\0", 1));
+        break;
+    }
+  }
+  return 0;
+}
 
-int main(int argc, char* argv[]) {
-  const Options options = ParseOptions(argc, argv);
+// Runs the selected mode, returning the exit status.
+int Run(const Options& options) {
   switch (options.mode) {
     case Options::Mode::kInfo:
       if (std::optional<fs::path> index_path = FindIndex()) {
-        std::println("Using {}", index_path->string());
-        return 0;
+        return PrintInfo(*index_path);
       } else {
         std::println("No .index file found.");
         return 1;
@@ -175,9 +543,34 @@ int main(int argc, char* argv[]) {
       }
       jcs::Build(".index");
       return 0;
+    case Options::Mode::kWatch:
+      if (std::optional<fs::path> index = FindIndex(); index.has_value()) {
+        fs::current_path(index->parent_path());
+      } else {
+        std::println(stderr,
+                     "No .index found. Run `jcs --index` to generate one.");
+        return 1;
+      }
+      jcs::Watch(".index");
+      return 0;
     case Options::Mode::kInteractive:
       return RunInteractive();
     case Options::Mode::kSearch:
-      return Search(options.args[0]);
+      return Search(options.args[0], options.format);
+    case Options::Mode::kFiles:
+      return SearchFiles(options.args[0], options.format);
+  }
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  const Options options = ParseOptions(argc, argv);
+  // Mistakes in .jcspolicy and unreadable indices are reported as errors.
+  try {
+    return Run(options);
+  } catch (const std::exception& error) {
+    std::println(stderr, "{}", error.what());
+    return 1;
   }
 }
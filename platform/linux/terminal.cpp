@@ -0,0 +1,44 @@
+#include "terminal.hpp"
+
+#include <poll.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include <stdexcept>
+
+namespace jcs {
+
+struct RawTerminal::State {
+  termios original;
+};
+
+bool IsTerminal() { return isatty(STDIN_FILENO) && isatty(STDOUT_FILENO); }
+
+RawTerminal::RawTerminal() : state_(std::make_unique<State>()) {
+  if (tcgetattr(STDIN_FILENO, &state_->original) < 0) {
+    throw std::runtime_error("Cannot get terminal attributes");
+  }
+  termios raw = state_->original;
+  // Signals are disabled so that Ctrl-C is read as a key, which gives us the
+  // chance to restore the terminal before exiting.
+  raw.c_lflag &= ~(ICANON | ECHO | ISIG);
+  raw.c_cc[VMIN] = 1;
+  raw.c_cc[VTIME] = 0;
+  if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) < 0) {
+    throw std::runtime_error("Cannot set terminal attributes");
+  }
+}
+
+RawTerminal::~RawTerminal() {
+  tcsetattr(STDIN_FILENO, TCSAFLUSH, &state_->original);
+}
+
+std::optional<char> RawTerminal::ReadKey(std::chrono::milliseconds timeout) {
+  pollfd input{.fd = STDIN_FILENO, .events = POLLIN, .revents = 0};
+  if (poll(&input, 1, int(timeout.count())) <= 0) return std::nullopt;
+  char c;
+  if (read(STDIN_FILENO, &c, 1) != 1) return '\x04';
+  return c;
+}
+
+}  // namespace jcs
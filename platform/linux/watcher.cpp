@@ -0,0 +1,126 @@
+#include "watcher.hpp"
+
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <map>
+#include <stdexcept>
+
+namespace jcs {
+namespace {
+
+namespace fs = std::filesystem;
+
+constexpr std::uint32_t kEvents = IN_CLOSE_WRITE | IN_CREATE | IN_DELETE |
+                                  IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR;
+
+}  // namespace
+
+struct Watcher::State {
+  ~State() { if (fd >= 0) close(fd); }
+
+  // Watches `directory` and the subdirectories which pass the filter. The
+  // files which are already present are added to `found`, if given, since
+  // they may have been created before the watch.
+  void WatchAll(const fs::path& directory, std::vector<fs::path>* found) {
+    Watch(directory);
+    std::error_code error;
+    auto i = fs::recursive_directory_iterator(
+        directory, fs::directory_options::skip_permission_denied, error);
+    for (; !error && i != fs::recursive_directory_iterator();
+         i.increment(error)) {
+      const fs::directory_entry& entry = *i;
+      if (entry.is_directory(error)) {
+        if (filter(entry.path())) {
+          Watch(entry.path());
+        } else {
+          i.disable_recursion_pending();
+        }
+      } else if (found) {
+        found->push_back(entry.path());
+      }
+    }
+  }
+
+  void Watch(const fs::path& directory) {
+    const int watch = inotify_add_watch(fd, directory.c_str(), kEvents);
+    if (watch >= 0) {
+      directories[watch] = directory;
+    } else if (errno == ENOSPC) {
+      throw std::runtime_error(
+          "Too many directories to watch. Exclude some of them in .jcspolicy "
+          "or raise fs.inotify.max_user_watches.");
+    }
+  }
+
+  // Stops watching `directory` and everything below it.
+  void Unwatch(const fs::path& directory) {
+    std::erase_if(directories, [&](const auto& entry) {
+      const auto& [watch, path] = entry;
+      if (std::ranges::mismatch(directory, path).in1 != directory.end()) {
+        return false;
+      }
+      inotify_rm_watch(fd, watch);
+      return true;
+    });
+  }
+
+  int fd = -1;
+  fs::path root;
+  Filter filter;
+  // The directory for each watch descriptor.
+  std::map<int, fs::path> directories;
+};
+
+Watcher::Watcher(const fs::path& root, Filter filter)
+    : state_(std::make_unique<State>()) {
+  state_->fd = inotify_init1(IN_CLOEXEC);
+  if (state_->fd < 0) throw std::runtime_error("Cannot initialize inotify");
+  state_->root = root;
+  state_->filter = std::move(filter);
+  state_->WatchAll(root, nullptr);
+}
+
+Watcher::~Watcher() = default;
+
+std::vector<fs::path> Watcher::Wait(std::chrono::milliseconds timeout) {
+  std::vector<fs::path> changed;
+  pollfd input{.fd = state_->fd, .events = POLLIN, .revents = 0};
+  if (poll(&input, 1, int(timeout.count())) <= 0) return changed;
+  alignas(inotify_event) char buffer[64 << 10];
+  const ssize_t size = read(state_->fd, buffer, sizeof(buffer));
+  if (size <= 0) return changed;
+  for (const char* p = buffer; p < buffer + size;) {
+    const auto* event = reinterpret_cast<const inotify_event*>(p);
+    p += sizeof(inotify_event) + event->len;
+    if (event->mask & IN_Q_OVERFLOW) {
+      changed.push_back(state_->root);
+      continue;
+    }
+    const auto i = state_->directories.find(event->wd);
+    if (i == state_->directories.end()) continue;
+    if (event->mask & IN_IGNORED) {
+      // The directory was deleted.
+      state_->directories.erase(i);
+      continue;
+    }
+    if (event->len == 0) continue;
+    const fs::path path = i->second / event->name;
+    if ((event->mask & IN_ISDIR) && (event->mask & (IN_CREATE | IN_MOVED_TO))) {
+      if (state_->filter(path)) state_->WatchAll(path, &changed);
+      continue;
+    }
+    // Watches follow a directory which is moved away, so stop watching it
+    // rather than reporting its changes under the old path.
+    if ((event->mask & IN_ISDIR) && (event->mask & IN_MOVED_FROM)) {
+      state_->Unwatch(path);
+    }
+    changed.push_back(path);
+  }
+  return changed;
+}
+
+}  // namespace jcs
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <chrono>
+#include <memory>
+#include <optional>
+
+namespace jcs {
+
+// Returns true if both stdin and stdout are attached to a terminal.
+bool IsTerminal();
+
+// Puts the terminal into raw mode for the lifetime of the object, so that keys
+// can be read as soon as they are pressed and are not echoed.
+class RawTerminal {
+ public:
+  RawTerminal();
+  ~RawTerminal();
+
+  // Not copyable.
+  RawTerminal(const RawTerminal&) = delete;
+  RawTerminal& operator=(const RawTerminal&) = delete;
+
+  // Waits up to `timeout` for a key press. Returns '\x04' (Ctrl-D) at the end
+  // of the input, or nullopt if no key was pressed in time.
+  std::optional<char> ReadKey(std::chrono::milliseconds timeout);
+
+ private:
+  struct State;
+  std::unique_ptr<State> state_;
+};
+
+}  // namespace jcs
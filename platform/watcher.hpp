@@ -0,0 +1,36 @@
+#pragma once
+
+#include <chrono>
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <vector>
+
+namespace jcs {
+
+// Reports changes to the files below a directory.
+class Watcher {
+ public:
+  // Returns true if changes below the given directory should be reported.
+  using Filter = std::function<bool(const std::filesystem::path&)>;
+
+  Watcher(const std::filesystem::path& root, Filter filter);
+  ~Watcher();
+
+  // Not copyable.
+  Watcher(const Watcher&) = delete;
+  Watcher& operator=(const Watcher&) = delete;
+
+  // Waits up to `timeout` for changes. Returns the paths which were created,
+  // modified, deleted, or renamed, or nothing if there were no changes in time.
+  // A directory which is deleted or moved away may be reported instead of the
+  // files inside it. If changes were lost, e.g. because too many happened at
+  // once, the root itself is reported: anything below it may have changed.
+  std::vector<std::filesystem::path> Wait(std::chrono::milliseconds timeout);
+
+ private:
+  struct State;
+  std::unique_ptr<State> state_;
+};
+
+}  // namespace jcs
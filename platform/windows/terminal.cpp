@@ -0,0 +1,71 @@
+#include "terminal.hpp"
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+
+#include <stdexcept>
+
+namespace jcs {
+
+struct RawTerminal::State {
+  HANDLE input, output;
+  DWORD input_mode, output_mode;
+};
+
+bool IsTerminal() {
+  DWORD mode;
+  return GetConsoleMode(GetStdHandle(STD_INPUT_HANDLE), &mode) &&
+         GetConsoleMode(GetStdHandle(STD_OUTPUT_HANDLE), &mode);
+}
+
+RawTerminal::RawTerminal() : state_(std::make_unique<State>()) {
+  state_->input = GetStdHandle(STD_INPUT_HANDLE);
+  state_->output = GetStdHandle(STD_OUTPUT_HANDLE);
+  if (!GetConsoleMode(state_->input, &state_->input_mode) ||
+      !GetConsoleMode(state_->output, &state_->output_mode)) {
+    throw std::runtime_error("Cannot get console mode");
+  }
+  // Ctrl-C is read as a key, which gives us the chance to restore the console
+  // before exiting. Output uses ANSI escape sequences.
+  const DWORD input_mode =
+      state_->input_mode &
+      ~(ENABLE_LINE_INPUT | ENABLE_ECHO_INPUT | ENABLE_PROCESSED_INPUT);
+  const DWORD output_mode =
+      state_->output_mode | ENABLE_VIRTUAL_TERMINAL_PROCESSING;
+  if (!SetConsoleMode(state_->input, input_mode) ||
+      !SetConsoleMode(state_->output, output_mode)) {
+    throw std::runtime_error("Cannot set console mode");
+  }
+}
+
+RawTerminal::~RawTerminal() {
+  SetConsoleMode(state_->input, state_->input_mode);
+  SetConsoleMode(state_->output, state_->output_mode);
+}
+
+std::optional<char> RawTerminal::ReadKey(std::chrono::milliseconds timeout) {
+  using Clock = std::chrono::steady_clock;
+  const auto deadline = Clock::now() + timeout;
+  while (true) {
+    const auto remaining =
+        std::chrono::duration_cast<std::chrono::milliseconds>(
+            deadline - Clock::now());
+    const DWORD wait = remaining.count() > 0 ? DWORD(remaining.count()) : 0;
+    if (WaitForSingleObject(state_->input, wait) != WAIT_OBJECT_0) {
+      return std::nullopt;
+    }
+    // The console also reports other events such as focus and key releases,
+    // which are skipped.
+    INPUT_RECORD record;
+    DWORD count;
+    if (!ReadConsoleInputA(state_->input, &record, 1, &count)) return '\x04';
+    if (count == 1 && record.EventType == KEY_EVENT &&
+        record.Event.KeyEvent.bKeyDown &&
+        record.Event.KeyEvent.uChar.AsciiChar != 0) {
+      return record.Event.KeyEvent.uChar.AsciiChar;
+    }
+    if (wait == 0) return std::nullopt;
+  }
+}
+
+}  // namespace jcs
@@ -0,0 +1,104 @@
+#include "watcher.hpp"
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+
+#include <stdexcept>
+#include <string>
+
+namespace jcs {
+namespace {
+
+namespace fs = std::filesystem;
+
+constexpr DWORD kEvents = FILE_NOTIFY_CHANGE_FILE_NAME |
+                          FILE_NOTIFY_CHANGE_DIR_NAME |
+                          FILE_NOTIFY_CHANGE_LAST_WRITE;
+
+}  // namespace
+
+struct Watcher::State {
+  ~State() {
+    if (directory != INVALID_HANDLE_VALUE) {
+      CancelIo(directory);
+      CloseHandle(directory);
+    }
+    if (overlapped.hEvent) CloseHandle(overlapped.hEvent);
+  }
+
+  // Starts waiting for the next batch of changes.
+  void Read() {
+    if (!ReadDirectoryChangesW(directory, buffer, sizeof(buffer), TRUE,
+                               kEvents, nullptr, &overlapped, nullptr)) {
+      throw std::runtime_error("Cannot watch for changes");
+    }
+  }
+
+  // Returns true if the changes to `path` should be reported, which is when
+  // every directory between the root and the path passes the filter.
+  bool Allowed(const fs::path& path) const {
+    fs::path directory = root;
+    for (const fs::path& part : path.parent_path().lexically_relative(root)) {
+      if (part == ".") continue;
+      directory /= part;
+      if (!filter(directory)) return false;
+    }
+    return true;
+  }
+
+  fs::path root;
+  Filter filter;
+  HANDLE directory = INVALID_HANDLE_VALUE;
+  OVERLAPPED overlapped = {};
+  alignas(DWORD) char buffer[64 << 10];
+};
+
+Watcher::Watcher(const fs::path& root, Filter filter)
+    : state_(std::make_unique<State>()) {
+  state_->root = root;
+  state_->filter = std::move(filter);
+  state_->directory = CreateFileW(
+      root.c_str(), FILE_LIST_DIRECTORY,
+      FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr,
+      OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OVERLAPPED,
+      nullptr);
+  if (state_->directory == INVALID_HANDLE_VALUE) {
+    throw std::runtime_error("Cannot open directory to watch");
+  }
+  state_->overlapped.hEvent = CreateEventW(nullptr, TRUE, FALSE, nullptr);
+  if (!state_->overlapped.hEvent) {
+    throw std::runtime_error("Cannot create event");
+  }
+  state_->Read();
+}
+
+Watcher::~Watcher() = default;
+
+std::vector<fs::path> Watcher::Wait(std::chrono::milliseconds timeout) {
+  std::vector<fs::path> changed;
+  if (WaitForSingleObject(state_->overlapped.hEvent, DWORD(timeout.count())) !=
+      WAIT_OBJECT_0) {
+    return changed;
+  }
+  DWORD size;
+  if (!GetOverlappedResult(state_->directory, &state_->overlapped, &size,
+                           FALSE)) {
+    throw std::runtime_error("Cannot read changes");
+  }
+  // An empty result means that the buffer overflowed.
+  if (size == 0) changed.push_back(state_->root);
+  for (const char* p = state_->buffer; size != 0;) {
+    const auto* info = reinterpret_cast<const FILE_NOTIFY_INFORMATION*>(p);
+    const fs::path path =
+        state_->root / std::wstring(info->FileName,
+                                    info->FileNameLength / sizeof(WCHAR));
+    if (state_->Allowed(path)) changed.push_back(path);
+    if (info->NextEntryOffset == 0) break;
+    p += info->NextEntryOffset;
+  }
+  ResetEvent(state_->overlapped.hEvent);
+  state_->Read();
+  return changed;
+}
+
+}  // namespace jcs
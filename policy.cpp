@@ -0,0 +1,172 @@
+#include "policy.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <charconv>
+#include <format>
+#include <fstream>
+#include <stdexcept>
+
+namespace jcs {
+namespace {
+
+namespace fs = std::filesystem;
+
+// Like git, only look for NUL bytes near the start of the file.
+constexpr std::size_t kBinaryCheckSize = 8000;
+
+std::string_view Trim(std::string_view text) {
+  while (!text.empty() && std::isspace((unsigned char)text.front())) {
+    text.remove_prefix(1);
+  }
+  while (!text.empty() && std::isspace((unsigned char)text.back())) {
+    text.remove_suffix(1);
+  }
+  return text;
+}
+
+}  // namespace
+
+Policy Policy::Load(const fs::path& path) {
+  Policy policy;
+  std::ifstream input(path);
+  if (!input) return policy;
+  std::string line;
+  int line_number = 0;
+  while (std::getline(input, line)) {
+    line_number++;
+    std::string_view text = Trim(line);
+    if (text.empty() || text.starts_with('#')) continue;
+    const auto split = std::ranges::find_if(
+        text, [](char c) { return std::isspace((unsigned char)c); });
+    const std::string_view directive(text.begin(), split);
+    const std::string_view argument =
+        Trim(std::string_view(split, text.end()));
+    const auto fail = [&](std::string_view message) {
+      throw std::runtime_error(std::format("{}:{}: {}", path.string(),
+                                           line_number, message));
+    };
+    if (argument.empty()) {
+      fail(std::format("{} expects an argument", directive));
+    }
+    const auto number = [&] {
+      std::uint64_t value = 0;
+      const auto [end, error] = std::from_chars(
+          argument.data(), argument.data() + argument.size(), value);
+      if (error != std::errc() || end != argument.data() + argument.size()) {
+        fail(std::format("{} expects a number", directive));
+      }
+      return value;
+    };
+    const auto boolean = [&] {
+      if (argument != "yes" && argument != "no") {
+        fail(std::format("{} expects yes or no", directive));
+      }
+      return argument == "yes";
+    };
+    if (directive == "extension") {
+      policy.extensions.emplace(argument);
+    } else if (directive == "directory") {
+      policy.dot_directories.emplace(argument);
+    } else if (directive == "include") {
+      policy.include.emplace_back(argument);
+    } else if (directive == "exclude") {
+      policy.exclude.emplace_back(argument);
+    } else if (directive == "max_file_size") {
+      policy.max_file_size = number();
+    } else if (directive == "max_line_length") {
+      policy.max_line_length = number();
+    } else if (directive == "store_contents") {
+      policy.store_contents = boolean();
+    } else if (directive == "build_memory") {
+      policy.build_memory = number();
+    } else if (directive == "sparse_grams") {
+      policy.sparse_grams = boolean();
+    } else {
+      fail(std::format("unknown directive {}", directive));
+    }
+  }
+  return policy;
+}
+
+bool Policy::AllowDirectory(std::string_view relative_path) const {
+  const std::string_view name =
+      relative_path.substr(relative_path.find_last_of('/') + 1);
+  if (name.starts_with('.') && !dot_directories.contains(name)) return false;
+  const std::string directory = std::string(relative_path) + "/";
+  return std::ranges::none_of(exclude, [&](std::string_view pattern) {
+    return GlobMatch(pattern, relative_path) || GlobMatch(pattern, directory);
+  });
+}
+
+bool Policy::AllowFile(std::string_view relative_path) const {
+  const auto matches = [&](std::string_view pattern) {
+    return GlobMatch(pattern, relative_path);
+  };
+  if (std::ranges::any_of(exclude, matches)) return false;
+  if (std::ranges::any_of(include, matches)) return true;
+  return extensions.contains(fs::path(relative_path).extension().string());
+}
+
+Policy::Verdict Policy::Check(std::string_view contents) const noexcept {
+  if (contents.size() > max_file_size) return Verdict::kTooLarge;
+  if (contents.substr(0, kBinaryCheckSize).contains('\0')) {
+    return Verdict::kBinary;
+  }
+  if (max_line_length == 0) return Verdict::kIndex;
+  while (contents.size() > max_line_length) {
+    const auto line_end = contents.find('\n');
+    if (line_end == contents.npos || line_end > max_line_length) {
+      return Verdict::kMinified;
+    }
+    contents.remove_prefix(line_end + 1);
+  }
+  return Verdict::kIndex;
+}
+
+std::string_view ToString(Policy::Verdict verdict) noexcept {
+  switch (verdict) {
+    case Policy::Verdict::kIndex:
+      return "indexed";
+    case Policy::Verdict::kTooLarge:
+      return "too large";
+    case Policy::Verdict::kBinary:
+      return "binary";
+    case Policy::Verdict::kMinified:
+      return "minified";
+  }
+  return "unknown";
+}
+
+bool GlobMatch(std::string_view pattern, std::string_view path) noexcept {
+  while (!pattern.empty()) {
+    if (pattern.starts_with("**")) {
+      pattern.remove_prefix(2);
+      // `**/` also matches zero directories.
+      if (pattern.starts_with('/') && GlobMatch(pattern.substr(1), path)) {
+        return true;
+      }
+      for (std::size_t i = 0; i <= path.size(); i++) {
+        if (GlobMatch(pattern, path.substr(i))) return true;
+      }
+      return false;
+    }
+    if (pattern.front() == '*') {
+      pattern.remove_prefix(1);
+      for (std::size_t i = 0; ; i++) {
+        if (GlobMatch(pattern, path.substr(i))) return true;
+        if (i == path.size() || path[i] == '/') return false;
+      }
+    }
+    if (path.empty()) return false;
+    if (pattern.front() == '?' ? path.front() == '/'
+                               : pattern.front() != path.front()) {
+      return false;
+    }
+    pattern.remove_prefix(1);
+    path.remove_prefix(1);
+  }
+  return path.empty();
+}
+
+}  // namespace jcs
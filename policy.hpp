@@ -0,0 +1,80 @@
+#ifndef POLICY_HPP_
+#define POLICY_HPP_
+
+#include <cstdint>
+#include <filesystem>
+#include <set>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace jcs {
+
+// Controls which files are indexed. The defaults can be adjusted per
+// repository with a `.jcspolicy` file in the indexed root, containing one
+// directive per line:
+//
+//   # Comments start with '#'.
+//   extension .rs          Also index files with this extension.
+//   directory .github      Also descend into this dot-directory.
+//   include docs/**        Index matching files regardless of extension.
+//   exclude third_party/** Never index matching files or directories.
+//   max_file_size 1048576  Skip files larger than this many bytes.
+//   max_line_length 2000   Skip files with longer lines (0 to disable).
+//   store_contents yes     Store compressed file contents in the index so
+//                          that searches do not need to open every file.
+//   build_memory 268435456 Keep the posting lists and stored contents within
+//                          roughly this many bytes while building the index by
+//                          spilling them to scratch files (0 for no limit).
+//   sparse_grams yes       Also index longer substrings chosen by a fixed
+//                          weighting, so that long terms can be looked up with
+//                          a few selective posting lists. This makes the index
+//                          larger and slower to build.
+//
+// Patterns are matched against paths relative to the indexed root using '/'
+// as the separator. `*` and `?` do not match '/', while `**` matches anything.
+struct Policy {
+  enum class Verdict {
+    kIndex,     // The file should be indexed.
+    kTooLarge,  // The file is larger than `max_file_size`.
+    kBinary,    // The file contains NUL bytes.
+    kMinified,  // The file has a line longer than `max_line_length`.
+  };
+
+  // Loads the policy in `path`, or the default policy if it does not exist.
+  static Policy Load(const std::filesystem::path& path);
+
+  // Returns true if the directory at `relative_path` should be searched.
+  bool AllowDirectory(std::string_view relative_path) const;
+
+  // Returns true if the file at `relative_path` should be indexed, based on
+  // its name alone.
+  bool AllowFile(std::string_view relative_path) const;
+
+  // Decides whether a file should be indexed based on its contents.
+  Verdict Check(std::string_view contents) const noexcept;
+
+  std::set<std::string, std::less<>> extensions = {
+      ".bat", ".cc",   ".cmake",   ".conf", ".cpp",   ".cs",  ".csproj",
+      ".css", ".csv",  ".fsproj",  ".h",    ".hpp",   ".hs",  ".html",
+      ".js",  ".json", ".md",      ".py",   ".props", ".ps1", ".targets",
+      ".tsv", ".txt",  ".vcxproj", ".xml",
+  };
+  std::set<std::string, std::less<>> dot_directories = {".config"};
+  std::vector<std::string> include;
+  std::vector<std::string> exclude;
+  std::uint64_t max_file_size = 4 << 20;
+  std::uint64_t max_line_length = 2000;
+  bool store_contents = false;
+  std::uint64_t build_memory = 0;
+  bool sparse_grams = false;
+};
+
+std::string_view ToString(Policy::Verdict verdict) noexcept;
+
+// Returns true if `path` matches the glob `pattern`.
+bool GlobMatch(std::string_view pattern, std::string_view path) noexcept;
+
+}  // namespace jcs
+
+#endif  // POLICY_HPP_
@@ -0,0 +1,67 @@
+#include "posting_cache.hpp"
+
+namespace jcs {
+
+PostingCache::Value PostingCache::Find(const Key& key) {
+  std::lock_guard lock(mutex_);
+  const auto i = index_.find(key);
+  if (i == index_.end()) return nullptr;
+  entries_.splice(entries_.begin(), entries_, i->second);
+  return i->second->second;
+}
+
+void PostingCache::Count(bool hit) {
+  std::lock_guard lock(mutex_);
+  if (hit) {
+    stats_.hits++;
+  } else {
+    stats_.misses++;
+  }
+}
+
+void PostingCache::Insert(Key key, Value value) {
+  Entry entry{std::move(key), std::move(value)};
+  const std::size_t size = Size(entry);
+  if (size > max_bytes_) return;
+  std::lock_guard lock(mutex_);
+  if (const auto i = index_.find(entry.first); i != index_.end()) {
+    // Another thread computed the same entry.
+    stats_.bytes -= Size(*i->second);
+    entries_.erase(i->second);
+    index_.erase(i);
+    stats_.entries--;
+  }
+  while (stats_.bytes + size > max_bytes_) {
+    const Entry& last = entries_.back();
+    stats_.bytes -= Size(last);
+    index_.erase(last.first);
+    entries_.pop_back();
+    stats_.entries--;
+    stats_.evictions++;
+  }
+  entries_.push_front(std::move(entry));
+  index_.emplace(entries_.front().first, entries_.begin());
+  stats_.bytes += size;
+  stats_.entries++;
+}
+
+void PostingCache::Clear() {
+  std::lock_guard lock(mutex_);
+  entries_.clear();
+  index_.clear();
+  stats_ = {};
+}
+
+PostingCache::Stats PostingCache::stats() const {
+  std::lock_guard lock(mutex_);
+  return stats_;
+}
+
+std::size_t PostingCache::Size(const Entry& entry) noexcept {
+  // Include a rough allowance for the bookkeeping of each entry.
+  constexpr std::size_t kOverhead = 128;
+  return kOverhead + entry.first.trigrams.size() * sizeof(int) +
+         entry.second->size() * sizeof(std::uint32_t);
+}
+
+}  // namespace jcs
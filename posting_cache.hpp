@@ -0,0 +1,79 @@
+#ifndef POSTING_CACHE_HPP_
+#define POSTING_CACHE_HPP_
+
+#include <compare>
+#include <cstdint>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace jcs {
+
+// A bounded cache of decoded posting lists, which may be shared between
+// threads. Each entry is keyed by the set of trigrams whose posting lists were
+// intersected to produce it, so a single trigram is a plain posting list. The
+// least recently used entries are evicted when the total size of the entries
+// exceeds the budget.
+class PostingCache {
+ public:
+  struct Key {
+    auto operator<=>(const Key&) const = default;
+
+    // Which index the lists are from, since the base index and its segments
+    // share a cache.
+    std::uint64_t layer;
+    // Which posting list table the trigrams refer to.
+    int table;
+    // Sorted and without duplicates.
+    std::vector<int> trigrams;
+  };
+
+  using Value = std::shared_ptr<const std::vector<std::uint32_t>>;
+
+  struct Stats {
+    std::uint64_t hits = 0;
+    std::uint64_t misses = 0;
+    std::uint64_t evictions = 0;
+    std::size_t entries = 0;
+    std::size_t bytes = 0;
+  };
+
+  explicit PostingCache(std::size_t max_bytes) : max_bytes_(max_bytes) {}
+
+  // Not copyable.
+  PostingCache(const PostingCache&) = delete;
+  PostingCache& operator=(const PostingCache&) = delete;
+
+  // Returns the cached list for `key`, or nullptr if it is not cached. A single
+  // lookup may probe several keys, so this does not count as a hit or miss;
+  // callers report the outcome of the lookup with Count().
+  Value Find(const Key& key);
+
+  void Count(bool hit);
+
+  // Adds an entry, evicting others as necessary. Lists larger than the whole
+  // budget are not cached.
+  void Insert(Key key, Value value);
+
+  void Clear();
+
+  Stats stats() const;
+
+ private:
+  using Entry = std::pair<Key, Value>;
+
+  static std::size_t Size(const Entry& entry) noexcept;
+
+  const std::size_t max_bytes_;
+  mutable std::mutex mutex_;
+  // Ordered from most to least recently used.
+  std::list<Entry> entries_;
+  std::map<Key, std::list<Entry>::iterator> index_;
+  Stats stats_;
+};
+
+}  // namespace jcs
+
+#endif  // POSTING_CACHE_HPP_
@@ -0,0 +1,215 @@
+#include "query.hpp"
+
+#include <algorithm>
+#include <span>
+
+namespace jcs {
+namespace {
+
+struct Token {
+  enum class Kind {
+    kTerm,     // A literal term.
+    kNotTerm,  // `-term`.
+    kOpen,     // `(`.
+    kNotOpen,  // `-(`.
+    kClose,    // `)`.
+    kOr,       // `|`.
+  };
+  Kind kind;
+  std::string text;
+};
+
+Expression Node(Expression::Kind kind) {
+  Expression result;
+  result.kind = kind;
+  return result;
+}
+
+Expression Sequence(std::string term) {
+  Expression result = Node(Expression::Kind::kSequence);
+  result.terms.push_back(std::move(term));
+  return result;
+}
+
+Expression Not(Expression child) {
+  Expression result = Node(Expression::Kind::kNot);
+  result.children.push_back(std::move(child));
+  return result;
+}
+
+// Removes children which have no terms and unwraps single-child nodes.
+Expression Simplify(Expression expression) {
+  std::erase_if(expression.children,
+                [](const Expression& child) { return child.empty(); });
+  if (expression.kind != Expression::Kind::kNot &&
+      expression.children.size() == 1) {
+    return std::move(expression.children.front());
+  }
+  return expression;
+}
+
+// A recursive descent parser for the grammar:
+//
+//   or  := and ('|' and)*
+//   and := (term | '-' term | '(' or ')' | '-(' or ')')*
+//
+// Malformed queries are parsed leniently: missing ')' are implied at the end of
+// the query and unmatched ')' are ignored.
+class Parser {
+ public:
+  explicit Parser(std::span<const Token> tokens) : tokens_(tokens) {}
+
+  Expression Parse() {
+    Expression result = Node(Expression::Kind::kAnd);
+    while (true) {
+      result.children.push_back(ParseOr());
+      if (done()) break;
+      i_++;  // Skip an unmatched ')'.
+    }
+    return Simplify(std::move(result));
+  }
+
+ private:
+  bool done() const { return i_ == tokens_.size(); }
+  bool next_is(Token::Kind kind) const {
+    return !done() && tokens_[i_].kind == kind;
+  }
+
+  Expression ParseOr() {
+    Expression result = Node(Expression::Kind::kOr);
+    result.children.push_back(ParseAnd());
+    while (next_is(Token::Kind::kOr)) {
+      i_++;
+      result.children.push_back(ParseAnd());
+    }
+    return Simplify(std::move(result));
+  }
+
+  Expression ParseAnd() {
+    Expression result = Node(Expression::Kind::kAnd);
+    while (!done() && !next_is(Token::Kind::kOr) &&
+           !next_is(Token::Kind::kClose)) {
+      const Token& token = tokens_[i_++];
+      switch (token.kind) {
+        case Token::Kind::kTerm:
+          // Adjacent terms must appear in order.
+          if (result.children.empty() ||
+              result.children.back().kind != Expression::Kind::kSequence) {
+            result.children.push_back(Node(Expression::Kind::kSequence));
+          }
+          result.children.back().terms.push_back(token.text);
+          break;
+        case Token::Kind::kNotTerm:
+          result.children.push_back(Not(Sequence(token.text)));
+          break;
+        case Token::Kind::kOpen:
+        case Token::Kind::kNotOpen: {
+          Expression group = ParseOr();
+          if (next_is(Token::Kind::kClose)) i_++;
+          if (token.kind == Token::Kind::kNotOpen) {
+            group = Not(std::move(group));
+          }
+          result.children.push_back(std::move(group));
+          break;
+        }
+        case Token::Kind::kClose:
+        case Token::Kind::kOr:
+          break;  // Unreachable: handled by the loop condition.
+      }
+    }
+    return Simplify(std::move(result));
+  }
+
+  std::span<const Token> tokens_;
+  std::size_t i_ = 0;
+};
+
+}  // namespace
+
+bool Expression::empty() const noexcept {
+  if (kind == Kind::kSequence) return terms.empty();
+  return std::ranges::all_of(children, &Expression::empty);
+}
+
+std::optional<Expression::Span> Expression::Match(
+    std::string_view line) const noexcept {
+  constexpr Span kNoTerm = {.column = std::string_view::npos, .length = 0};
+  switch (kind) {
+    case Kind::kSequence: {
+      if (terms.empty()) return kNoTerm;
+      const auto column = line.find(terms.front());
+      if (column == line.npos) return std::nullopt;
+      std::size_t i = column + terms.front().size();
+      for (std::string_view term : std::span(terms).subspan(1)) {
+        const auto c = line.find(term, i);
+        if (c == line.npos) return std::nullopt;
+        i = c + term.size();
+      }
+      return Span{.column = column, .length = i - column};
+    }
+    case Kind::kAnd: {
+      Span span = kNoTerm;
+      for (const Expression& child : children) {
+        const std::optional<Span> c = child.Match(line);
+        if (!c) return std::nullopt;
+        if (c->column < span.column) span = *c;
+      }
+      return span;
+    }
+    case Kind::kOr: {
+      std::optional<Span> span;
+      for (const Expression& child : children) {
+        const std::optional<Span> c = child.Match(line);
+        if (c && (!span || c->column < span->column)) span = c;
+      }
+      return span;
+    }
+    case Kind::kNot:
+      if (children.front().Match(line)) return std::nullopt;
+      return kNoTerm;
+  }
+  return std::nullopt;
+}
+
+Query Query::Parse(std::string_view query) noexcept {
+  Query result;
+  std::vector<Token> tokens;
+  const char* i = query.data();
+  const char* const end = i + query.size();
+  while (true) {
+    while (i != end && *i == ' ') i++;
+    if (i == end) break;
+    const char* const start = i;
+    std::string text;
+    while (true) {
+      if (i == end || *i == ' ') break;
+      if (*i == '\\' && i + 1 != end) i++;
+      text.push_back(*i);
+      i++;
+    }
+    // Classify using the raw text so that escaped characters are never
+    // treated specially.
+    const std::string_view raw(start, i);
+    if (raw == "(") {
+      tokens.push_back({.kind = Token::Kind::kOpen, .text = ""});
+    } else if (raw == "-(") {
+      tokens.push_back({.kind = Token::Kind::kNotOpen, .text = ""});
+    } else if (raw == ")") {
+      tokens.push_back({.kind = Token::Kind::kClose, .text = ""});
+    } else if (raw == "|") {
+      tokens.push_back({.kind = Token::Kind::kOr, .text = ""});
+    } else if (raw.starts_with("file:")) {
+      if (text.size() > 5) result.files.push_back(text.substr(5));
+    } else if (raw.starts_with("-file:")) {
+      if (text.size() > 6) result.excluded_files.push_back(text.substr(6));
+    } else if (raw.starts_with('-') && raw.size() > 1) {
+      tokens.push_back({.kind = Token::Kind::kNotTerm, .text = text.substr(1)});
+    } else {
+      tokens.push_back({.kind = Token::Kind::kTerm, .text = std::move(text)});
+    }
+  }
+  result.expression = Parser(tokens).Parse();
+  return result;
+}
+
+}  // namespace jcs
@@ -0,0 +1,63 @@
+#ifndef QUERY_HPP_
+#define QUERY_HPP_
+
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace jcs {
+
+// A boolean expression over the literal terms in a line.
+struct Expression {
+  enum class Kind {
+    kSequence,  // All of `terms` appear in order.
+    kAnd,       // All of `children` match.
+    kOr,        // Any of `children` match.
+    kNot,       // The only child does not match.
+  };
+
+  // The part of a line which matched.
+  struct Span {
+    std::size_t column, length;
+  };
+
+  // Returns true if the expression has no terms and so matches everything.
+  bool empty() const noexcept;
+
+  // Returns the leftmost part of `line` which the terms matched, a span at
+  // `npos` if the expression matches without matching any term (e.g. a
+  // negation), or nullopt if it does not match. A sequence matches from the
+  // start of its first term to the end of its last.
+  std::optional<Span> Match(std::string_view line) const noexcept;
+
+  Kind kind = Kind::kAnd;
+  std::vector<std::string> terms;
+  std::vector<Expression> children;
+};
+
+// A parsed search query. Queries are space-separated terms, which must appear
+// on a line in order. The following tokens are treated specially:
+//
+//   a | b        Either side matches.
+//   -term        The line does not contain `term`.
+//   ( ... )      Grouping. Parentheses must be separate tokens, and `-(`
+//                negates a group.
+//   file:text    Only search files whose path contains `text`.
+//   -file:text   Do not search files whose path contains `text`.
+//
+// Adjacent expressions must all match. A backslash escapes the next character,
+// so `\-x` or `\|` can be used to search for these literally.
+struct Query {
+  static Query Parse(std::string_view query) noexcept;
+
+  Expression expression;
+  // `file:` terms, which must all appear in the path.
+  std::vector<std::string> files;
+  // `-file:` terms, none of which may appear in the path.
+  std::vector<std::string> excluded_files;
+};
+
+}  // namespace jcs
+
+#endif  // QUERY_HPP_
@@ -0,0 +1,184 @@
+#include "watch.hpp"
+
+#include "index.hpp"
+#include "platform/watcher.hpp"
+#include "policy.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <exception>
+#include <filesystem>
+#include <format>
+#include <optional>
+#include <print>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace jcs {
+namespace {
+
+namespace fs = std::filesystem;
+
+using Clock = std::chrono::steady_clock;
+using std::chrono_literals::operator""ms;
+using std::chrono_literals::operator""s;
+
+// Changes which happen in quick succession go into the same segment, so that
+// e.g. switching branches does not produce a segment for every file.
+constexpr auto kSettleTime = 200ms;
+constexpr auto kMaxBatchTime = 2s;
+
+// Segments are merged into the base index once there are this many of them,
+// or when no files have changed for a while.
+constexpr int kMaxSegments = 8;
+constexpr auto kIdleTime = 30s;
+
+// Escapes `text` for use as a single query term.
+std::string Escape(std::string_view text) {
+  std::string result;
+  for (char c : text) {
+    if (c == ' ' || c == '\\') result.push_back('\\');
+    result.push_back(c);
+  }
+  return result;
+}
+
+// Returns true if `file` is the index at `index` or one of the files written
+// next to it: segments, and temporary and scratch files.
+bool IsIndexFile(const fs::path& file, const fs::path& index) {
+  return file.parent_path() == index.parent_path() &&
+         file.filename().string().starts_with(index.filename().string());
+}
+
+// Merges the segments into the base index on a background thread.
+class Compactor {
+ public:
+  explicit Compactor(std::string_view path) : path_(path) {}
+
+  // Starts merging the segments which exist now. Returns false if a merge is
+  // already in progress.
+  bool Start() {
+    if (running_) return false;
+    running_ = true;
+    thread_ = std::jthread([this] {
+      try {
+        Compact(path_);
+        std::println("compacted");
+      } catch (std::exception& error) {
+        std::println(stderr, "Compaction failed: {}", error.what());
+      }
+      running_ = false;
+    });
+    return true;
+  }
+
+ private:
+  std::string path_;
+  std::atomic_bool running_ = false;
+  std::jthread thread_;
+};
+
+}  // namespace
+
+void Watch(std::string_view path) {
+  const fs::path root = fs::current_path();
+  const fs::path index_path = root / path;
+  const Policy policy = Policy::Load(root / ".jcspolicy");
+  Watcher watcher(root, [&](const fs::path& directory) {
+    return policy.AllowDirectory(
+        directory.lexically_relative(root).generic_string());
+  });
+  // Leftover segments which could not be removed may be newer than the index.
+  std::uint64_t generation = Index(path).generation();
+  if (const std::vector<std::uint64_t> segments = FindSegments(path);
+      !segments.empty()) {
+    generation = std::max(generation, segments.back());
+  }
+  Compactor compactor(path);
+  // The number of segments written since the last compaction started.
+  int pending = 0;
+  const auto write_segment = [&](std::vector<std::string> files,
+                                 std::vector<std::string> deleted) {
+    if (files.empty() && deleted.empty()) return;
+    generation++;
+    const std::size_t num_files = files.size(), num_deleted = deleted.size();
+    BuildSegment(path, generation, std::move(files), std::move(deleted));
+    std::println("generation {}: {} changed, {} deleted", generation,
+                 num_files, num_deleted);
+    if (++pending >= kMaxSegments && compactor.Start()) pending = 0;
+  };
+  // Compares the whole tree with the index, for the changes which were made
+  // before watching started or which the watcher lost.
+  const auto rescan = [&] {
+    std::vector<std::string> files, deleted;
+    FindChanges(path, files, deleted);
+    write_segment(std::move(files), std::move(deleted));
+  };
+  auto last_change = Clock::now();
+  // Writing segments and compacting changes the index files, which must not
+  // count as changes to the tree.
+  const auto wait = [&](std::chrono::milliseconds timeout) {
+    std::vector<fs::path> changes = watcher.Wait(timeout);
+    std::erase_if(changes, [&](const fs::path& change) {
+      return IsIndexFile(change, index_path);
+    });
+    return changes;
+  };
+  rescan();
+  std::println("Watching {} for changes.", root.string());
+  while (true) {
+    std::vector<fs::path> changes = wait(1s);
+    if (changes.empty()) {
+      if (pending > 0 && Clock::now() - last_change > kIdleTime &&
+          compactor.Start()) {
+        pending = 0;
+      }
+      continue;
+    }
+    const auto deadline = Clock::now() + kMaxBatchTime;
+    while (Clock::now() < deadline) {
+      std::vector<fs::path> more = wait(kSettleTime);
+      if (more.empty()) break;
+      changes.append_range(more);
+    }
+    last_change = Clock::now();
+    if (std::ranges::find(changes, root) != changes.end()) {
+      rescan();
+      continue;
+    }
+    std::set<std::string> files, deleted;
+    std::optional<Index> index;
+    for (const fs::path& change : changes) {
+      std::error_code error;
+      const std::string relative =
+          change.lexically_relative(root).generic_string();
+      if (fs::is_regular_file(change, error)) {
+        if (policy.AllowFile(relative)) files.insert(change.string());
+        continue;
+      }
+      // New directories are ignored: the files inside them are reported too.
+      if (fs::exists(change, error)) continue;
+      if (policy.AllowFile(relative)) deleted.insert(change.string());
+      // A directory may have been deleted or moved away without reporting the
+      // files inside it, so look them up in the index.
+      // File filters match paths below the root anywhere, so check that each
+      // result is really inside the directory.
+      if (!index) index.emplace(path);
+      const std::string directory = (change / "").string();
+      const std::string query = std::format(
+          "file:{}",
+          Escape((change.lexically_relative(root) / "").string()));
+      for (std::string_view file : index->SearchFiles(query)) {
+        if (file.starts_with(directory)) deleted.emplace(file);
+      }
+    }
+    for (const std::string& file : files) deleted.erase(file);
+    write_segment(std::vector(std::from_range, files),
+                  std::vector(std::from_range, deleted));
+  }
+}
+
+}  // namespace jcs
@@ -0,0 +1,15 @@
+#ifndef WATCH_HPP_
+#define WATCH_HPP_
+
+#include <string_view>
+
+namespace jcs {
+
+// Keeps the index at `path` up to date with the files in the current directory
+// until the process is stopped. Files which change are indexed into delta
+// segments, which are merged into the base index in the background.
+void Watch(std::string_view path);
+
+}  // namespace jcs
+
+#endif  // WATCH_HPP_